@@ -7,13 +7,18 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <stdint.h>
+#include <poll.h>
+#include <sys/ioctl.h>
 
 #define BUFFER_SIZE 1024
+#define UDP_TIMEOUT_MS 100 // Espera por resposta antes de retransmitir
+#define UDP_RETRIES 5      // Tentativas antes de recorrer ao TCP
+#define RETRY_SEQUENCE_SLOT 99 // Posição de moves[] com o número de sequência UDP no reenvio pelo TCP
 #define MAX_ROWS 10
 #define MAX_COLS 10
 
 // Definição dos comandos
-enum Commands { START = 0, MOVE = 1, MAP = 2, HINT = 3, UPDATE = 4, WIN = 5 , RESET = 6, EXIT = 7, ERROR = 8, GAMEOVER = 9 };
+enum Commands { START = 0, MOVE = 1, MAP = 2, HINT = 3, UPDATE = 4, WIN = 5 , RESET = 6, EXIT = 7, ERROR = 8, GAMEOVER = 9, RESUME = 10, JOIN = 11, SPECTATE = 12, MUTATE = 13 };
 enum Directions { UP = 1, RIGHT = 2, DOWN = 3, LEFT = 4};
 
 // Definição da estrutura Action
@@ -23,12 +28,45 @@ struct action {
     int32_t moves[100];
     int32_t board[10][10];
     char error_message[256]; // Novo campo para a mensagem de erro
+    uint32_t session_token[2]; // Token de sessão (alto, baixo), recebido no START
+    int32_t board_size[2];     // Linhas e colunas do tabuleiro em uso, 0 sem tabuleiro
+    int32_t board_origin[2];   // Posição no labirinto de board[0][0]
+};
+
+// Datagrama do transporte UDP (MOVE e MAP)
+struct datagram {
+    uint32_t sequence; // Cresce a cada comando novo; repetido nas retransmissões
+    struct action act;
 };
 #pragma pack()
 
+// Token da sessão atual, usado para retomar o jogo após uma queda de conexão
+static uint32_t session_token[2];
+static int has_session_token = 0;
+
+// Socket UDP opcional (-u) e o último número de sequência usado
+static int udp_sockfd = -1;
+static uint32_t udp_sequence = 0;
+
+// O que está desenhado no terminal, para redesenhar só as células que mudaram
+static struct {
+    int drawn;
+    int rows;
+    int cols;
+    int32_t cells[MAX_ROWS][MAX_COLS];
+} screen;
+
+// Um quadro inteiro é montado aqui e escrito com uma única chamada
+static char frame_buf[MAX_ROWS * MAX_COLS * 24 + 64];
+static size_t frame_len = 0;
+
 // Funções auxiliares
+int connect_to_server(const char *host, const char *port, int socktype);
+int exchange_udp(struct action *act);
+int reconnect_and_resume(int sockfd, const char *host, const char *port, struct action *resumed);
+int is_idempotent(int command);
 void send_action(int sockfd, struct action *act);
-void receive_action(int sockfd, struct action *act);
+int receive_action(int sockfd, struct action *act);
 void serialize_action(struct action *act);
 void deserialize_action(struct action *act);
 void handle_move(struct action *act);
@@ -36,64 +74,58 @@ void handle_reset(struct action *act);
 void handle_start(struct action *act);
 void handle_map(struct action *act);
 void handle_error(struct action *act);
+void spectate(int sockfd, const char *token);
 void print_board(struct action *act);
 void print_possible_moves(struct action* act);
-void encontradimensoes(int *rows, int *cols, int board[10][10]);
+void print_moves(const char *label, struct action *act);
+const char *cell_glyph(int value, char *scratch);
+void frame_append(const char *text);
+void frame_write(void);
+void render_reset(void);
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Uso: %s <endereço IP do servidor> <porta>\n", argv[0]);
+    if (argc != 3 && !(argc == 5 && strcmp(argv[3], "-u") == 0)) {
+        fprintf(stderr, "Uso: %s <endereço IP do servidor> <porta> [-u <porta udp>]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    int sockfd;
-    struct addrinfo hints, *res, *p;
-    int status;
-
-    // Configuração de hints para getaddrinfo
-    memset(&hints, 0, sizeof hints);
-    hints.ai_socktype = SOCK_STREAM;
-
-    // Resolver o endereço do servidor
-    if ((status = getaddrinfo(argv[1], argv[2], &hints, &res)) != 0) {
-        fprintf(stderr, "Erro em getaddrinfo: %s\n", gai_strerror(status));
+    int sockfd = connect_to_server(argv[1], argv[2], SOCK_STREAM);
+    if (sockfd == -1) {
+        fprintf(stderr, "client: falha ao conectar\n");
         exit(EXIT_FAILURE);
     }
 
-    // Tentar conectar a um dos resultados retornados
-    for (p = res; p != NULL; p = p->ai_next) {
-        if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-            perror("client: socket");
-            continue;
+    // Com -u, MOVE e MAP vão por UDP; a sessão continua sendo criada pelo TCP
+    if (argc == 5) {
+        udp_sockfd = connect_to_server(argv[1], argv[4], SOCK_DGRAM);
+        if (udp_sockfd == -1) {
+            fprintf(stderr, "client: falha ao abrir o socket UDP\n");
+            exit(EXIT_FAILURE);
         }
-
-        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-            close(sockfd);
-            perror("client: connect");
-            continue;
-        }
-
-        break; // Sucesso
     }
 
-    if (p == NULL) {
-        fprintf(stderr, "client: falha ao conectar\n");
-        exit(EXIT_FAILURE);
-    }
-
-    freeaddrinfo(res); // Não precisamos mais da lista ligada de resultados
-
     char input[BUFFER_SIZE];
+    atexit(render_reset);
 
     while (1) {
-        scanf("%s", input);
+        if (scanf("%s", input) != 1) {
+            break; // Fim da entrada
+        }
 
         struct action act;
-        memset(act.moves, 0, sizeof(act.moves));
-        memset(act.board, 0, sizeof(act.board));
+        memset(&act, 0, sizeof(act));
 
         int command = -1;
-        if (strcasecmp(input, "start") == 0) {
+        if (strcasecmp(input, "token") == 0) {
+            // Mostra o token da sessão para que outros possam assistir
+            printf("%08x%08x\n", session_token[0], session_token[1]);
+            continue;
+        } else if (strcasecmp(input, "spectate") == 0) {
+            // spectate <token>: assiste ao jogo de outra sessão
+            scanf("%s", input);
+            spectate(sockfd, input);
+            continue;
+        } else if (strcasecmp(input, "start") == 0) {
             command = START;
         } else if (strcasecmp(input, "map") == 0) {
             command = MAP;
@@ -103,6 +135,19 @@ int main(int argc, char *argv[]) {
             command = RESET;
         } else if (strcasecmp(input, "exit") == 0) {
             command = EXIT;
+        } else if (strcasecmp(input, "join") == 0) {
+            // join <sala>: entra no modo multijogador da sala indicada
+            command = JOIN;
+            if (scanf("%d", &act.moves[0]) != 1) {
+                act.moves[0] = 0;
+            }
+        } else if (strcasecmp(input, "mutate") == 0) {
+            // mutate <segredo> <linha> <coluna> <0 parede | 1 caminho>: altera o labirinto (administrador)
+            command = MUTATE;
+            act.moves[0] = 1;
+            if (scanf("%255s %d %d %d", act.error_message, &act.moves[1], &act.moves[2], &act.moves[3]) != 4) {
+                command = ERROR;
+            }
         } else if (strcasecmp(input, "up") == 0) {
             command = MOVE;
             act.moves[0] = UP;
@@ -120,14 +165,51 @@ int main(int argc, char *argv[]) {
         }
 
         act.type = command;
-        send_action(sockfd, &act);
-        receive_action(sockfd, &act);
+        memcpy(act.session_token, session_token, sizeof(session_token));
+        struct action request = act; // send_action serializa no próprio buffer
+
+        int answered = 0;
+        if (udp_sockfd != -1 && has_session_token && (command == MOVE || command == MAP)) {
+            answered = exchange_udp(&act); // Sem resposta: recorre ao TCP
+            if (!answered) {
+                // Com o mesmo número o servidor não aplica o comando duas vezes
+                act.moves[RETRY_SEQUENCE_SLOT] = udp_sequence;
+            }
+        }
+
+        if (!answered) {
+            send_action(sockfd, &act);
+            if (receive_action(sockfd, &act) <= 0) {
+                // Conexão caiu: retoma a sessão numa nova conexão. O comando pode
+                // ter sido aplicado antes da queda, então só os idempotentes são
+                // reenviados; para os demais vale o estado devolvido pelo RESUME
+                sockfd = reconnect_and_resume(sockfd, argv[1], argv[2], &act);
+                if (!is_idempotent(command)) {
+                    printf("Conexão retomada; confira se o comando foi aplicado.\n");
+                    if (act.type == UPDATE) {
+                        print_possible_moves(&act);
+                    }
+                    continue;
+                }
+                act = request;
+                send_action(sockfd, &act);
+                if (receive_action(sockfd, &act) <= 0) {
+                    printf("Servidor desconectado.\n");
+                    exit(1);
+                }
+            }
+        }
+
+        if ((command == START || command == RESET || command == JOIN) && act.type == UPDATE) {
+            memcpy(session_token, act.session_token, sizeof(session_token));
+            has_session_token = 1;
+        }
 
         if (act.type == WIN) {
             printf("You escaped!\n");
             print_board(&act);
         } else if (act.type == UPDATE) {
-            if (command == START) {
+            if (command == START || command == JOIN) {
                 handle_start(&act);
             } else if (command == MOVE) {
                 handle_move(&act);
@@ -138,6 +220,10 @@ int main(int argc, char *argv[]) {
                 exit(0);
             } else if(command == RESET) {
                 handle_reset(&act);
+            } else if (command == HINT) {
+                print_moves("Hint", &act);
+            } else if (command == MUTATE) {
+                printf("Maze changed: %d cells.\n", act.moves[0]);
             }
         }
         else if(act.type == GAMEOVER){ // ao enviar comandos e o jogo esta acabado faça nada
@@ -153,18 +239,114 @@ int main(int argc, char *argv[]) {
     return 0;
 }
 
+int connect_to_server(const char *host, const char *port, int socktype) {
+    int sockfd = -1;
+    struct addrinfo hints, *res, *p;
+    int status;
+
+    // Configuração de hints para getaddrinfo
+    memset(&hints, 0, sizeof hints);
+    hints.ai_socktype = socktype;
+
+    // Resolver o endereço do servidor
+    if ((status = getaddrinfo(host, port, &hints, &res)) != 0) {
+        fprintf(stderr, "Erro em getaddrinfo: %s\n", gai_strerror(status));
+        exit(EXIT_FAILURE);
+    }
+
+    // Tentar conectar a um dos resultados retornados
+    for (p = res; p != NULL; p = p->ai_next) {
+        if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
+            perror("client: socket");
+            continue;
+        }
+
+        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+            close(sockfd);
+            perror("client: connect");
+            continue;
+        }
+
+        break; // Sucesso
+    }
+
+    freeaddrinfo(res); // Não precisamos mais da lista ligada de resultados
+
+    return p == NULL ? -1 : sockfd;
+}
+
+int reconnect_and_resume(int sockfd, const char *host, const char *port, struct action *resumed) {
+    close(sockfd);
+
+    if (!has_session_token) {
+        printf("Servidor desconectado.\n");
+        exit(1);
+    }
+
+    sockfd = connect_to_server(host, port, SOCK_STREAM);
+    if (sockfd == -1) {
+        printf("Servidor desconectado.\n");
+        exit(1);
+    }
+
+    memset(resumed, 0, sizeof(*resumed));
+    resumed->type = RESUME;
+    memcpy(resumed->session_token, session_token, sizeof(session_token));
+    send_action(sockfd, resumed);
+
+    if (receive_action(sockfd, resumed) <= 0 || (resumed->type != UPDATE && resumed->type != GAMEOVER)) {
+        printf("Não foi possível retomar a sessão.\n");
+        exit(1);
+    }
+
+    return sockfd;
+}
+
+int is_idempotent(int command) {
+    // Repetir estes comandos não muda o jogo
+    return command == MAP || command == HINT || command == EXIT;
+}
+
+int exchange_udp(struct action *act) {
+    struct datagram request;
+    struct datagram reply;
+
+    // O mesmo número de sequência em todas as tentativas: o servidor não repete a jogada
+    request.sequence = htonl(++udp_sequence);
+    request.act = *act;
+    serialize_action(&request.act);
+
+    for (int attempt = 0; attempt < UDP_RETRIES; attempt++) {
+        send(udp_sockfd, &request, sizeof(request), 0);
+
+        struct pollfd pfd = { .fd = udp_sockfd, .events = POLLIN };
+        while (poll(&pfd, 1, UDP_TIMEOUT_MS) > 0) {
+            ssize_t n = recv(udp_sockfd, &reply, sizeof(reply), 0);
+            // Respostas atrasadas de comandos anteriores são descartadas
+            if (n == sizeof(reply) && ntohl(reply.sequence) == udp_sequence) {
+                *act = reply.act;
+                deserialize_action(act);
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
 void send_action(int sockfd, struct action *act) {
     serialize_action(act);
-    send(sockfd, act, sizeof(struct action), 0);
+    // MSG_NOSIGNAL: uma conexão caída é tratada no recv, sem matar o cliente
+    send(sockfd, act, sizeof(struct action), MSG_NOSIGNAL);
 }
 
-void receive_action(int sockfd, struct action *act) {
+int receive_action(int sockfd, struct action *act) {
     int num_bytes = recv(sockfd, act, sizeof(struct action), MSG_WAITALL);
     if (num_bytes <= 0) {
-        printf("Servidor desconectado.\n");
-        exit(1);
+        return num_bytes;
     }
     deserialize_action(act);
+    return num_bytes;
 }
 
 void serialize_action(struct action *act) {
@@ -177,6 +359,12 @@ void serialize_action(struct action *act) {
             act->board[i][j] = htonl(act->board[i][j]);
         }
     }
+    act->session_token[0] = htonl(act->session_token[0]);
+    act->session_token[1] = htonl(act->session_token[1]);
+    for (int k = 0; k < 2; k++) {
+        act->board_size[k] = htonl(act->board_size[k]);
+        act->board_origin[k] = htonl(act->board_origin[k]);
+    }
 }
 
 void deserialize_action(struct action *act) {
@@ -189,6 +377,39 @@ void deserialize_action(struct action *act) {
             act->board[i][j] = ntohl(act->board[i][j]);
         }
     }
+    act->session_token[0] = ntohl(act->session_token[0]);
+    act->session_token[1] = ntohl(act->session_token[1]);
+    for (int k = 0; k < 2; k++) {
+        act->board_size[k] = ntohl(act->board_size[k]);
+        act->board_origin[k] = ntohl(act->board_origin[k]);
+    }
+}
+
+void spectate(int sockfd, const char *token) {
+    struct action act;
+    memset(&act, 0, sizeof(act));
+    act.type = SPECTATE;
+
+    unsigned long long value = strtoull(token, NULL, 16);
+    act.session_token[0] = (uint32_t)(value >> 32);
+    act.session_token[1] = (uint32_t)value;
+    send_action(sockfd, &act);
+
+    // O servidor envia o tabuleiro a cada jogada até a conexão cair
+    while (receive_action(sockfd, &act) > 0) {
+        if (act.type == ERROR) {
+            handle_error(&act);
+            return;
+        }
+        print_board(&act);
+        printf("\n");
+        if (act.type == WIN) {
+            printf("The player escaped!\n");
+        }
+    }
+
+    printf("Servidor desconectado.\n");
+    exit(1);
 }
 
 void handle_move(struct action *act) {
@@ -208,7 +429,11 @@ void handle_start(struct action *act) {
 }
 
 void print_possible_moves(struct action* act) {
-    printf("Possible moves: ");
+    print_moves("Possible moves", act);
+}
+
+void print_moves(const char *label, struct action *act) {
+    printf("%s: ", label);
     int first = 1; // Variável para verificar se é o primeiro movimento
 
     for (int i = 0; i < 100; i++) {
@@ -250,71 +475,125 @@ void handle_map(struct action *act) {
     print_board(act);
 }
 
-void encontradimensoes(int *rows, int *cols, int board[10][10]) {
-    int max_rows = 0;
-    int max_cols = 0;
+const char *cell_glyph(int value, char *scratch) {
+    switch (value) {
+        case 5:
+            return "+ ";
+        case 3:
+            return "X ";
+        case 1:
+            return "_ ";
+        case 0:
+            return "# ";
+        case 2:
+            return "> ";
+        case 4:
+            return "? ";
+        case 6:
+            return "P "; // Outro jogador da sala
+        case -1:
+            return "  ";
+        default:
+            snprintf(scratch, 16, "%d ", value);
+            return scratch;
+    }
+}
 
-    // Encontrar o número real de linhas
-    for (int i = 0; i < 10; i++) {
-        int is_valid_row = 0;
-        for (int j = 0; j < 10; j++) {
-            if (board[i][j] != -1) {
-                is_valid_row = 1;
-                break;
-            }
-        }
-        if (is_valid_row) {
-            max_rows++;
-        } else {
-            break; // Linha com todos -1 encontrada, fim das linhas válidas
-        }
+void frame_append(const char *text) {
+    size_t len = strlen(text);
+    if (frame_len + len <= sizeof(frame_buf)) {
+        memcpy(frame_buf + frame_len, text, len);
+        frame_len += len;
     }
+}
 
-    // Encontrar o número real de colunas
-    for (int j = 0; j < 10; j++) {
-        int is_valid_col = 0;
-        for (int i = 0; i < 10; i++) {
-            if (board[i][j] != -1) {
-                is_valid_col = 1;
-                break;
-            }
-        }
-        if (is_valid_col) {
-            max_cols++;
-        } else {
-            break; // Coluna com todos -1 encontrada, fim das colunas válidas
+void frame_write(void) {
+    // O que já foi impresso com printf vem antes do quadro
+    fflush(stdout);
+    size_t written = 0;
+    while (written < frame_len) {
+        ssize_t n = write(STDOUT_FILENO, frame_buf + written, frame_len - written);
+        if (n <= 0) {
+            break;
         }
+        written += n;
     }
+    frame_len = 0;
+}
 
-    *rows = max_rows;
-    *cols = max_cols;
+void render_reset(void) {
+    // Devolve o terminal inteiro para a rolagem normal
+    if (screen.drawn) {
+        frame_append("\x1b[r");
+        frame_write();
+        screen.drawn = 0;
+    }
 }
 
 void print_board(struct action *act) {
-    int numRows, numCols;
-    encontradimensoes(&numRows, &numCols, act->board);
-
-    for (int i = 0; i < numRows; i++) {
-        for (int j = 0; j < numCols; j++) {
-            int value = act->board[i][j];
-            if (value == -1) {
-                continue;
-            } else if (value == 5) {
-                printf("+ ");
-            } else if (value == 3) {
-                printf("X ");
-            } else if (value == 1) {
-                printf("_ ");
-            } else if (value == 0) {
-                printf("# ");
-            } else if (value == 2) {
-                printf("> ");
-            } else if (value == 4) {
-                printf("? ");
-            } else {
-                printf("%d ", value);
+    int rows = act->board_size[0];
+    int cols = act->board_size[1];
+    if (rows <= 0 || cols <= 0 || rows > MAX_ROWS || cols > MAX_COLS) {
+        return; // Resposta sem tabuleiro
+    }
+
+    char scratch[16];
+    char seq[32];
+
+    // Fora de um terminal (pipe, arquivo) o quadro sai inteiro, como texto
+    if (!isatty(STDOUT_FILENO)) {
+        for (int i = 0; i < rows; i++) {
+            for (int j = 0; j < cols; j++) {
+                if (act->board[i][j] != -1) {
+                    frame_append(cell_glyph(act->board[i][j], scratch));
+                }
             }
+            frame_append("\n");
         }
-        printf("\n");
+        frame_write();
+        return;
     }
+
+    // No terminal o tabuleiro fica fixo no topo e os comandos rolam abaixo dele.
+    // O primeiro quadro (ou uma mudança de tamanho) desenha tudo; os seguintes
+    // só reescrevem as células que mudaram.
+    if (!screen.drawn || rows != screen.rows || cols != screen.cols) {
+        struct winsize ws;
+        int term_rows = (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0) ? ws.ws_row : 24;
+
+        frame_append("\x1b[r\x1b[2J\x1b[H");
+        for (int i = 0; i < rows; i++) {
+            for (int j = 0; j < cols; j++) {
+                frame_append(cell_glyph(act->board[i][j], scratch));
+            }
+            frame_append("\n");
+        }
+        snprintf(seq, sizeof(seq), "\x1b[%d;%dr\x1b[%d;1H", rows + 2, term_rows, term_rows);
+        frame_append(seq);
+
+        screen.drawn = 1;
+        screen.rows = rows;
+        screen.cols = cols;
+    } else {
+        // Guarda o cursor da área de comandos e volta para ele no fim
+        frame_append("\x1b" "7");
+        for (int i = 0; i < rows; i++) {
+            int cursor = -1; // Coluna onde o cursor está nesta linha, -1 se não estiver nela
+            for (int j = 0; j < cols; j++) {
+                if (act->board[i][j] == screen.cells[i][j]) {
+                    continue;
+                }
+                if (cursor != j) {
+                    snprintf(seq, sizeof(seq), "\x1b[%d;%dH", i + 1, 2 * j + 1);
+                    frame_append(seq);
+                }
+                frame_append(cell_glyph(act->board[i][j], scratch));
+                cursor = j + 1;
+            }
+        }
+        frame_append("\x1b" "8");
+    }
+
+    memcpy(screen.cells, act->board, sizeof(screen.cells));
+    frame_write();
 }
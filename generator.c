@@ -0,0 +1,81 @@
+// generator.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mazegen.h"
+
+void usage(const char *program);
+double elapsed_seconds(const struct timespec *start);
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        usage(argv[0]);
+    }
+
+    MazeGenOptions opts;
+    mazegen_defaults(&opts);
+    opts.rows = (uint32_t)strtoul(argv[1], NULL, 10);
+    opts.cols = (uint32_t)strtoul(argv[2], NULL, 10);
+    const char *output_file = NULL;
+
+    // Optional flags
+    for (int k = 3; k < argc; k += 2) {
+        if (k + 1 >= argc) {
+            usage(argv[0]);
+        }
+        if (strcmp(argv[k], "-s") == 0) {
+            opts.seed = strtoull(argv[k + 1], NULL, 0);
+        } else if (strcmp(argv[k], "-d") == 0) {
+            opts.density = atof(argv[k + 1]);
+        } else if (strcmp(argv[k], "-b") == 0) {
+            opts.branching = atof(argv[k + 1]);
+        } else if (strcmp(argv[k], "-j") == 0) {
+            opts.threads = atoi(argv[k + 1]);
+        } else if (strcmp(argv[k], "-o") == 0) {
+            output_file = argv[k + 1];
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    const char *problem = mazegen_check(&opts);
+    if (problem) {
+        fprintf(stderr, "Error: %s.\n", problem);
+        exit(EXIT_FAILURE);
+    }
+
+    FILE *out = stdout;
+    if (output_file && !(out = fopen(output_file, "w"))) {
+        perror("Error opening the output file");
+        exit(EXIT_FAILURE);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (mazegen_write(&opts, out) == -1 || fflush(out) == EOF) {
+        perror("Error writing the maze");
+        exit(EXIT_FAILURE);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    fprintf(stderr, "generated a %ux%u maze with seed %llu in %.2fs\n",
+            opts.rows, opts.cols, (unsigned long long)opts.seed, elapsed_seconds(&start));
+    return 0;
+}
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s <rows> <cols> [-s <seed>] [-d <density 0..1>] [-b <branching 0..1>] [-j <threads>] [-o <output file>]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+double elapsed_seconds(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
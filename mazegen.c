@@ -0,0 +1,278 @@
+// mazegen.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mazegen.h"
+
+// Work handed to one thread: a strip to build and, when writing, to format as text
+typedef struct {
+    const MazeGenOptions *opts;
+    uint32_t first_strip;
+    uint32_t strip_step;
+    uint8_t *cells;
+    char *text;
+    size_t text_len;
+} StripJob;
+
+uint64_t splitmix64(uint64_t *state);
+uint64_t probability_threshold(double p);
+uint32_t random_below(uint64_t *state, uint32_t n);
+uint32_t strip_rows(const MazeGenOptions *opts, uint32_t strip);
+int worker_count(const MazeGenOptions *opts);
+size_t format_strip(const MazeGenOptions *opts, uint32_t rows, const uint8_t *cells, char *text);
+void *generate_worker(void *arg);
+void *write_worker(void *arg);
+
+void mazegen_defaults(MazeGenOptions *opts) {
+    opts->rows = 0;
+    opts->cols = 0;
+    opts->seed = 1;
+    opts->density = 0.0;
+    opts->branching = 0.5;
+    opts->threads = 0;
+}
+
+const char *mazegen_check(const MazeGenOptions *opts) {
+    // Start and exit need a room each: at least 3x5 or 5x3
+    if (opts->rows < 3 || opts->cols < 3 || (opts->rows < 5 && opts->cols < 5)) {
+        return "the maze must be at least 3x5 or 5x3";
+    }
+    if (!(opts->density >= 0.0 && opts->density <= 1.0)) {
+        return "density must be between 0 and 1";
+    }
+    if (!(opts->branching >= 0.0 && opts->branching <= 1.0)) {
+        return "branching must be between 0 and 1";
+    }
+    if (opts->threads < 0) {
+        return "the number of threads cannot be negative";
+    }
+    return NULL;
+}
+
+uint32_t mazegen_strip_count(const MazeGenOptions *opts) {
+    return (opts->rows + MAZEGEN_STRIP_ROWS - 1) / MAZEGEN_STRIP_ROWS;
+}
+
+uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+uint64_t probability_threshold(double p) {
+    // A draw below the threshold happens with probability p
+    if (p >= 1.0) {
+        return UINT64_MAX;
+    }
+    return (uint64_t)(p * 18446744073709551616.0);
+}
+
+uint32_t random_below(uint64_t *state, uint32_t n) {
+    return (uint32_t)(((splitmix64(state) >> 32) * (uint64_t)n) >> 32);
+}
+
+uint32_t strip_rows(const MazeGenOptions *opts, uint32_t strip) {
+    uint32_t first = strip * MAZEGEN_STRIP_ROWS;
+    uint32_t left = opts->rows - first;
+    return left < MAZEGEN_STRIP_ROWS ? left : MAZEGEN_STRIP_ROWS;
+}
+
+void mazegen_strip(const MazeGenOptions *opts, uint32_t strip, uint8_t *cells) {
+    // Rooms sit on odd rows and columns, walls in between. Each strip is a
+    // sidewinder maze: its first room row is one long corridor and every run
+    // of a later row opens one passage north, so the strip is a spanning tree.
+    // Strips after the first open one passage into the strip above, which
+    // makes the whole maze connected and therefore solvable.
+    uint32_t cols = opts->cols;
+    uint32_t room_rows = (opts->rows - 1) / 2;
+    uint32_t room_cols = (cols - 1) / 2;
+    uint32_t base = strip * MAZEGEN_STRIP_ROWS;
+    uint32_t rows = strip_rows(opts, strip);
+
+    uint32_t r_first = base / 2;
+    uint32_t r_end = (base + rows) / 2;
+    if (r_end > room_rows) {
+        r_end = room_rows;
+    }
+
+    uint64_t state = opts->seed ^ (0xD1B54A32D192ED03ULL * (strip + 1));
+    uint64_t close_run = probability_threshold(opts->branching);
+    uint64_t knock_out = probability_threshold(opts->density);
+
+    memset(cells, MAZE_WALL, (size_t)rows * cols);
+
+    for (uint32_t r = r_first; r < r_end; r++) {
+        uint8_t *row = cells + (size_t)(2 * r + 1 - base) * cols;
+        uint8_t *above = row - cols;
+        uint32_t run_start = 0;
+
+        for (uint32_t c = 0; c < room_cols; c++) {
+            int last = (c == room_cols - 1);
+            row[2 * c + 1] = MAZE_PATH;
+
+            if (r == r_first) {
+                if (!last) {
+                    row[2 * c + 2] = MAZE_PATH;
+                }
+                // Extra passages into the strip above only add loops
+                if (r > 0 && opts->density > 0.0 && splitmix64(&state) < knock_out) {
+                    above[2 * c + 1] = MAZE_PATH;
+                }
+                continue;
+            }
+
+            if (last || splitmix64(&state) < close_run) {
+                uint32_t north = run_start + random_below(&state, c - run_start + 1);
+                above[2 * north + 1] = MAZE_PATH;
+                run_start = c + 1;
+            } else {
+                row[2 * c + 2] = MAZE_PATH;
+            }
+
+            if (opts->density > 0.0) {
+                if (!last && splitmix64(&state) < knock_out) {
+                    row[2 * c + 2] = MAZE_PATH;
+                }
+                if (splitmix64(&state) < knock_out) {
+                    above[2 * c + 1] = MAZE_PATH;
+                }
+            }
+        }
+
+        if (r == r_first && r > 0) {
+            above[2 * random_below(&state, room_cols) + 1] = MAZE_PATH;
+        }
+    }
+
+    // Start in the top-left room, exit in the bottom-right one
+    if (strip == 0) {
+        cells[cols + 1] = MAZE_START;
+    }
+    uint32_t exit_row = 2 * room_rows - 1;
+    if (exit_row >= base && exit_row < base + rows) {
+        cells[(size_t)(exit_row - base) * cols + 2 * room_cols - 1] = MAZE_EXIT;
+    }
+}
+
+int worker_count(const MazeGenOptions *opts) {
+    int threads = opts->threads;
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+    uint32_t strips = mazegen_strip_count(opts);
+    return (uint32_t)threads > strips ? (int)strips : threads;
+}
+
+void *generate_worker(void *arg) {
+    StripJob *job = arg;
+    uint32_t strips = mazegen_strip_count(job->opts);
+    for (uint32_t s = job->first_strip; s < strips; s += job->strip_step) {
+        mazegen_strip(job->opts, s, job->cells + (size_t)s * MAZEGEN_STRIP_ROWS * job->opts->cols);
+    }
+    return NULL;
+}
+
+uint8_t *mazegen_generate(const MazeGenOptions *opts) {
+    if (mazegen_check(opts)) {
+        return NULL;
+    }
+    uint8_t *cells = malloc((size_t)opts->rows * opts->cols);
+    if (!cells) {
+        return NULL;
+    }
+
+    // Strips are interleaved across threads; each thread owns its rows outright
+    int threads = worker_count(opts);
+    pthread_t tids[threads];
+    StripJob jobs[threads];
+    for (int t = 0; t < threads; t++) {
+        jobs[t] = (StripJob){ opts, (uint32_t)t, (uint32_t)threads, cells, NULL, 0 };
+        if (t > 0 && pthread_create(&tids[t], NULL, generate_worker, &jobs[t]) != 0) {
+            jobs[t].strip_step = 0; // Could not start: done below on this thread
+        }
+    }
+    generate_worker(&jobs[0]);
+    for (int t = 1; t < threads; t++) {
+        if (jobs[t].strip_step == 0) {
+            jobs[t].strip_step = threads;
+            generate_worker(&jobs[t]);
+        } else {
+            pthread_join(tids[t], NULL);
+        }
+    }
+    return cells;
+}
+
+size_t format_strip(const MazeGenOptions *opts, uint32_t rows, const uint8_t *cells, char *text) {
+    // Every cell is a single digit followed by a space, or a newline at the end of the row
+    char *out = text;
+    for (uint32_t i = 0; i < rows; i++) {
+        for (uint32_t j = 0; j < opts->cols; j++) {
+            *out++ = (char)('0' + *cells++);
+            *out++ = ' ';
+        }
+        out[-1] = '\n';
+    }
+    return out - text;
+}
+
+void *write_worker(void *arg) {
+    StripJob *job = arg;
+    uint32_t rows = strip_rows(job->opts, job->first_strip);
+    mazegen_strip(job->opts, job->first_strip, job->cells);
+    job->text_len = format_strip(job->opts, rows, job->cells, job->text);
+    return NULL;
+}
+
+int mazegen_write(const MazeGenOptions *opts, FILE *out) {
+    if (mazegen_check(opts)) {
+        return -1;
+    }
+
+    // Strips are built and formatted in waves of one per thread, then
+    // written in order, so memory stays at a few strips whatever the size
+    int threads = worker_count(opts);
+    size_t cells_size = (size_t)MAZEGEN_STRIP_ROWS * opts->cols;
+    uint8_t *cells = malloc(cells_size * threads);
+    char *text = malloc(cells_size * 2 * threads);
+    if (!cells || !text) {
+        free(cells);
+        free(text);
+        return -1;
+    }
+
+    pthread_t tids[threads];
+    StripJob jobs[threads];
+    int result = 0;
+    uint32_t strips = mazegen_strip_count(opts);
+
+    for (uint32_t wave = 0; wave < strips && result == 0; wave += threads) {
+        int started[threads];
+        int count = 0;
+        for (int t = 0; t < threads && wave + t < strips; t++) {
+            jobs[t] = (StripJob){ opts, wave + t, 0, cells + cells_size * t, text + cells_size * 2 * t, 0 };
+            started[t] = pthread_create(&tids[t], NULL, write_worker, &jobs[t]) == 0;
+            count++;
+        }
+        for (int t = 0; t < count; t++) {
+            if (started[t]) {
+                pthread_join(tids[t], NULL);
+            } else {
+                write_worker(&jobs[t]);
+            }
+            if (result == 0 && fwrite(jobs[t].text, 1, jobs[t].text_len, out) != jobs[t].text_len) {
+                result = -1;
+            }
+        }
+    }
+
+    free(cells);
+    free(text);
+    return result;
+}
@@ -0,0 +1,50 @@
+// mazegen.h
+
+#ifndef MAZEGEN_H
+#define MAZEGEN_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Cell values, in the server's input format
+enum MazeCells {
+    MAZE_WALL = 0,
+    MAZE_PATH = 1,
+    MAZE_START = 2,
+    MAZE_EXIT = 3
+};
+
+// The maze is built in strips of this many rows. Each strip has its own
+// random stream, so the result depends only on the options and never on
+// how many threads produced it. Must be even.
+#define MAZEGEN_STRIP_ROWS 256
+
+typedef struct {
+    uint32_t rows;    // Size of the output, at least 3x5 or 5x3
+    uint32_t cols;
+    uint64_t seed;
+    double density;   // 0..1, share of extra walls knocked down; 0 gives a perfect maze
+    double branching; // 0..1, how often a corridor ends and forks off its row above
+    int threads;      // Worker threads, 0 picks one per online CPU
+} MazeGenOptions;
+
+// Fills opts with the defaults used by the generator tool
+void mazegen_defaults(MazeGenOptions *opts);
+
+// Returns NULL when opts are valid, or a message saying what is wrong
+const char *mazegen_check(const MazeGenOptions *opts);
+
+uint32_t mazegen_strip_count(const MazeGenOptions *opts);
+
+// Builds one strip into cells: MAZEGEN_STRIP_ROWS (fewer for the last strip)
+// rows of opts->cols cells, row-major. Strips are independent of each other.
+void mazegen_strip(const MazeGenOptions *opts, uint32_t strip, uint8_t *cells);
+
+// Builds the whole maze in memory: rows * cols cells, row-major. NULL on failure.
+uint8_t *mazegen_generate(const MazeGenOptions *opts);
+
+// Streams the maze to out in the server's input format, one strip per
+// thread at a time. Returns 0 on success, -1 on failure.
+int mazegen_write(const MazeGenOptions *opts, FILE *out);
+
+#endif
@@ -1,5 +1,7 @@
 // server.c
 
+#define _GNU_SOURCE // recvmmsg / sendmmsg
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,13 +9,68 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <stdint.h>
-
-#define BUFFER_SIZE 1024
-#define MAX_ROWS 10
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/random.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <pthread.h>
+
+#define MAX_ROWS 10                  // Size of the board sent to clients: a window of the maze
 #define MAX_COLS 10
+#define TILE_BITS 6
+#define TILE_SIZE (1 << TILE_BITS)   // Per-game and per-room cell state is kept in square tiles
+#define DEFAULT_SESSION_TTL 300      // Seconds a disconnected session stays resumable
+#define DEFAULT_PARKED_SESSIONS 1024 // Disconnected sessions kept at once; more are refused, not evicted
+#define SESSION_HASH_BUCKETS 2048    // Must be a power of two
+#define MAX_CONNECTIONS 1024
+#define RESERVED_FDS 16              // Descriptors kept for the listener, UDP, epoll, files and snapshots
+#define MAX_EVENTS 64
+#define MAX_FRAMES_PER_READ 16       // Commands handled per wakeup, so one client cannot hog the loop
+#define TX_QUEUE_FRAMES 8            // Replies queued for a slow reader before it is dropped
+#define SPECTATOR_BACKLOG 4          // Queued boards after which a spectator starts skipping
+#define MAX_SKIPPED_FRAMES 32        // Boards in a row a spectator may skip before it is dropped
+#define DEFAULT_IDLE_TIMEOUT 120     // Seconds a connection may go without sending a command
+#define READ_FRAME_TIMEOUT 10        // Seconds to finish sending a command once it started
+#define WRITE_TIMEOUT 10             // Seconds to drain queued replies
+#define TIMER_TICK_MS 100
+#define WHEEL_LEVELS 3
+#define WHEEL_SLOT_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+#define WHEEL_MAX_TICKS ((uint64_t)1 << (WHEEL_SLOT_BITS * WHEEL_LEVELS))
+#define SECONDS_TO_TICKS(s) ((uint64_t)(s) * 1000 / TIMER_TICK_MS)
+#define UDP_BATCH 32                 // Datagrams read and answered per system call
+#define UDP_CLIENT_FD -1             // client_fd given to handlers for commands that came over UDP
+#define RETRY_SEQUENCE_SLOT 99       // moves[] entry with the UDP sequence of a command retried over TCP
+#define MAX_ROOMS 64
+#define DEFAULT_VISION_RADIUS 1      // Cells a player sees around itself, walls permitting
+#define MAX_VISION_RADIUS 64
+#define PLAYER_SIGHT_RADIUS 3        // Other players closer than this show up on MAP
+#define OTHER_PLAYER 6               // Board value for another player in the same room
+#define DEFAULT_CHECKPOINT_INTERVAL 60 // Seconds between snapshots of every session
+#define CHECKPOINT_BATCH (256 * 1024) // Bytes of sessions written per pass of the event loop
+#define SNAPSHOT_MAGIC "MAZESNAP"
+#define SNAPSHOT_VERSION 2
+#define DISTANCE_UNREACHABLE UINT32_MAX
+#define COMMAND_CLASSES 3            // MOVE, board reads (MAP and HINT) and everything else
+#define MOVE_RATE 20                 // Commands per second a connection may keep up in each class
+#define MOVE_BURST 40                // and how many it may send at once after a quiet spell
+#define BOARD_READ_RATE 10
+#define BOARD_READ_BURST 20
+#define CONTROL_RATE 2
+#define CONTROL_BURST 10
+#define OVERLOAD_TARGET_US 5000      // Queueing delay the server tries to stay under
+#define OVERLOAD_INTERVAL_US 100000  // Window over which the smallest delay is taken
 
 // Definition of commands
-enum Commands { START = 0, MOVE = 1, MAP = 2, HINT = 3, UPDATE = 4, WIN = 5 , RESET = 6, EXIT = 7, ERROR = 8, GAMEOVER = 9 };
+enum Commands { START = 0, MOVE = 1, MAP = 2, HINT = 3, UPDATE = 4, WIN = 5 , RESET = 6, EXIT = 7, ERROR = 8, GAMEOVER = 9, RESUME = 10, JOIN = 11, SPECTATE = 12, MUTATE = 13 };
 
 // Definition of the action structure
 #pragma pack(1)
@@ -22,30 +79,351 @@ struct action {
     int32_t moves[100];
     int32_t board[10][10];
     char error_message[256];
+    uint32_t session_token[2]; // Resume token (high, low), issued on START
+    int32_t board_size[2];     // Rows and columns of board in use, 0 when there is no board
+    int32_t board_origin[2];   // Maze row and column shown at board[0][0]
+};
+
+// UDP transport for MOVE and MAP. The session token inside the action
+// authenticates the datagram; the sequence number makes retransmissions safe.
+struct datagram {
+    uint32_t sequence; // Increases with every new command of the client
+    struct action act;
 };
 #pragma pack()
 
-// Definition of the GameState structure
+// The maze read from the input file, shared by every game. Players are not
+// stored in it: each game draws its own position on top of it.
 typedef struct {
     uint32_t actual_rows; // Actual number of rows in the map
     uint32_t actual_cols; // Actual number of columns in the map
-    uint32_t player_i;
-    uint32_t player_j;
     uint32_t inicio_i;
     uint32_t inicio_j;
     uint32_t fim_i;
     uint32_t fim_j;
+    uint32_t tiles_per_row; // TILE_SIZE tiles covering the maze
+    uint32_t tile_count;
+    uint64_t base_fingerprint; // Hash of the cells as read from the file
+    uint64_t fingerprint;   // base_fingerprint chained with every change since
+    int8_t *cells;          // actual_rows * actual_cols, row-major
+} Maze;
+
+// A multiplayer room: many players moving through the shared maze.
+// A move touches just the two per-cell counters involved, with atomic
+// updates. Counters are allocated a tile at a time, only where players
+// have been. The room table itself (ids, creating and freeing rooms) is
+// not synchronized and belongs to the event loop thread.
+typedef struct {
+    int32_t id; // Chosen by the clients with JOIN, 0 when the slot is free
+    atomic_uint players;
+    _Atomic(atomic_uint *) *occupancy; // Players standing on each cell, one entry per tile
+} Room;
+
+typedef struct {
+    uint32_t key;   // Tile number + 1, 0 for an empty slot
+    uint64_t *rows; // TILE_SIZE rows of TILE_SIZE bits
+} DiscoveredTile;
+
+// Cells a player has seen. Only the tiles the player got close to are
+// allocated, so a game in a huge maze costs as much as the area it explored.
+typedef struct {
+    DiscoveredTile *tiles; // Open addressing, capacity is a power of two
+    uint32_t capacity;
+    uint32_t count;
+} DiscoveredMap;
+
+// Scan state of one octant of the player's field of view. The transform
+// maps octant coordinates (dx along the row, dy away from the player) onto
+// maze offsets, so one scan routine covers all eight octants.
+typedef struct {
+    struct GameState *gameState;
+    int radius;
+    int xx, xy, yx, yy;
+} Shadowcast;
+
+// Definition of the GameState structure
+typedef struct GameState {
+    uint32_t player_i;
+    uint32_t player_j;
     uint32_t game_over; // New field to indicate if the game is over
     uint32_t game_inicialized; // New field to indicate if the game is initialized
-    int32_t matrix[MAX_ROWS][MAX_COLS];
-    int32_t matrix_decoberto[MAX_ROWS][MAX_COLS];
+    uint64_t session_token; // Token used to resume the session after a disconnect
+    Room *room; // Multiplayer room, NULL when playing alone
+    DiscoveredMap discovered;
 } GameState;
 
+// Compact form of a disconnected session. The maze itself is not stored:
+// it is rebuilt from the template loaded at startup.
+typedef struct {
+    uint64_t token;
+    time_t parked_at;
+    uint32_t player_i;
+    uint32_t player_j;
+    uint32_t game_over;
+    int32_t room_id; // Room to rejoin on RESUME, 0 for a solo game
+    DiscoveredMap discovered; // Taken over from the game while parked
+    int32_t bucket_next; // Next entry in the same hash bucket (or in the free list), -1 ends
+    int32_t age_prev;    // Parked sessions are kept in parking order, oldest first
+    int32_t age_next;
+} ParkedSession;
+
+// Session snapshot file, used as is through mmap: a header, an open
+// addressing table of fixed-size records keyed by token, then the
+// discovered tiles of every record, then the maze changes applied since
+// startup. Written in host byte order, for restarting on the same machine.
+typedef struct {
+    char magic[8];             // SNAPSHOT_MAGIC, written last
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t base_fingerprint; // The maze file the changes apply to
+    uint64_t maze_fingerprint; // After the changes
+    uint64_t changes_offset;   // File offset of the changes, (cell << 1) | value each
+    uint64_t change_count;
+    uint64_t created_at;
+    uint64_t capacity;         // Slots in the record table, a power of two
+    uint64_t records;
+} SnapshotHeader;
+
+typedef struct {
+    uint64_t token;            // 0 for an empty slot
+    int64_t parked_at;         // When the session was parked, or seen live
+    uint64_t tiles_offset;     // File offset of its discovered tiles
+    uint32_t tile_count;
+    uint32_t player_i;
+    uint32_t player_j;
+    uint32_t game_over;
+    int32_t room_id;
+    uint32_t reserved;
+} SnapshotRecord;
+
+typedef struct {
+    uint32_t key;              // Same tile numbering as DiscoveredMap
+    uint32_t reserved;
+    uint64_t rows[TILE_SIZE];
+} SnapshotTile;
+
+// Growable ring of cell numbers (row * actual_cols + column)
+typedef struct {
+    uint32_t *items;
+    uint32_t capacity; // Power of two
+    uint32_t head;
+    uint32_t len;
+} CellQueue;
+
+typedef struct {
+    uint32_t distance;
+    uint32_t cell;
+} HeapEntry;
+
+// Commands a connection may still send right away in one class, refilled
+// continuously. Counted in millionths of a command so refills stay exact.
+typedef struct {
+    uint64_t tokens;
+    uint64_t updated_us;
+} TokenBucket;
+
+typedef struct {
+    uint64_t due_tick;
+    uint32_t i;
+    uint32_t j;
+    int value;
+} ScheduledMutation;
+
+// Timers live intrusively inside their owner; arm, cancel and expire are O(1)
+typedef struct Timer {
+    struct Timer *prev;
+    struct Timer *next;  // NULL when the timer is not armed
+    uint64_t expires;    // Absolute tick
+    void (*callback)(struct Timer *timer);
+    void *owner;
+} Timer;
+
+// Hierarchical timer wheel: level 0 has one slot per tick, every level above
+// covers WHEEL_SLOTS times the range of the one below and is cascaded down
+// when the lower level wraps around.
+typedef struct {
+    Timer slots[WHEEL_LEVELS][WHEEL_SLOTS]; // List heads
+    uint64_t now;                           // Current tick
+} TimerWheel;
+
+// An encoded message ready to go on the wire. Frames are reference counted
+// so a board fanned out to many spectators is encoded once and never copied.
+typedef struct Frame {
+    struct Frame *next_free;
+    uint32_t refs;
+    uint8_t data[sizeof(struct action)];
+} Frame;
+
+typedef struct {
+    Frame *frame;
+    size_t offset; // Bytes of the frame already written
+} QueuedFrame;
+
+// One accepted TCP connection and the game it is playing
+typedef struct Connection {
+    int fd;          // -1 when the slot is free
+    int closing;     // Close as soon as the queued replies are written
+    uint32_t events; // Events currently registered with epoll
+    GameState gameState;
+    uint8_t rx_buf[sizeof(struct action)]; // Partially received command
+    size_t rx_len;
+    QueuedFrame tx_queue[TX_QUEUE_FRAMES]; // Frames the socket did not take yet
+    uint32_t tx_head;
+    uint32_t tx_count;
+    uint64_t spectating;                   // Token of the watched session, 0 if none
+    struct Connection *spectate_prev;      // Spectators hashed by the token they watch
+    struct Connection *spectate_next;
+    uint32_t frames_skipped;
+    uint64_t indexed_token;                // Token the live session is indexed under, 0 if none
+    struct Connection *live_next;          // Live sessions hashed by token
+    uint32_t udp_sequence;                 // Last sequence number answered over UDP
+    Frame *udp_reply;                      // That answer, resent when the client retransmits
+    TokenBucket buckets[COMMAND_CLASSES];  // Rate limit of each class of commands
+    Timer idle_timer;
+    Timer read_timer;
+    Timer write_timer;
+    int32_t next_free;
+} Connection;
+
+static Maze maze; // Read once at startup
+static uint64_t *maze_changes; // Every change applied, in order, for the snapshots
+static uint64_t maze_change_count;
+static uint64_t maze_change_capacity;
+static Room rooms[MAX_ROOMS];
+static uint32_t session_ttl = DEFAULT_SESSION_TTL;
+static uint32_t max_parked_sessions = DEFAULT_PARKED_SESSIONS;
+static uint32_t idle_timeout = DEFAULT_IDLE_TIMEOUT;
+static uint32_t vision_radius = DEFAULT_VISION_RADIUS;
+
+static TimerWheel timer_wheel;
+static uint64_t clock_start_ms;
+
+static const struct {
+    uint32_t rate;
+    uint32_t burst;
+} command_limits[COMMAND_CLASSES] = {
+    { MOVE_RATE, MOVE_BURST },
+    { BOARD_READ_RATE, BOARD_READ_BURST },
+    { CONTROL_RATE, CONTROL_BURST },
+};
+
+// Overload detection in the manner of CoDel: a burst drains within an
+// interval, so only when even the least delayed command of a whole interval
+// waited longer than the target is the queue standing and load shed.
+static struct {
+    uint64_t batch_ready_us;   // Since when the events of this batch may have been waiting
+    uint64_t batch_started_us; // When epoll returned them
+    uint64_t interval_end_us;
+    uint64_t min_delay_us;     // Smallest queueing delay seen in this interval
+    int overloaded;
+} overload = { .min_delay_us = UINT64_MAX };
+
+// Printed on SIGUSR1
+static struct {
+    uint64_t rate_limited[COMMAND_CLASSES];
+    uint64_t overloaded;        // Commands answered with an overload error
+    uint64_t shed_connections;  // Connections closed on accept while overloaded
+} rejections;
+static volatile sig_atomic_t stats_requested;
+static Timer housekeeping_timer;
+
+static int epoll_fd = -1;
+static int listen_fd = -1;
+static int accept_paused;           // Out of descriptors: the listener is left out of epoll
+static time_t accept_error_logged;
+static uint64_t accept_errors;      // Accept failures since the last one logged
+static Connection connections[MAX_CONNECTIONS];
+static int connection_limit;        // Slots of connections in use, bounded by RLIMIT_NOFILE
+static int32_t connections_free = -1;
+static Connection **fd_connections; // Indexed by file descriptor
+static int fd_table_size;
+static Frame *free_frames;
+static Connection *spectators[SESSION_HASH_BUCKETS];
+static Connection *live_sessions[SESSION_HASH_BUCKETS];
+
+static int udp_fd = -1;
+static struct action *udp_reply; // Where send_action puts the answer to a UDP command
+
+static ParkedSession *parked_sessions; // max_parked_sessions entries
+static int32_t *parked_buckets;
+static uint32_t parked_bucket_mask;
+static int32_t parked_free = -1;
+static int32_t parked_oldest = -1;
+static int32_t parked_newest = -1;
+
+// Steps from each cell to the exit, DISTANCE_UNREACHABLE for walls and cut-off
+// cells. Built once at startup and repaired incrementally when the maze changes.
+static uint32_t *distance_to_exit;
+static CellQueue repair_queue;
+static CellQueue repair_affected;
+static struct {
+    HeapEntry *entries;
+    uint32_t len;
+    uint32_t capacity;
+} repair_heap;
+
+static const char *admin_secret; // NULL when MUTATE is disabled
+static ScheduledMutation *mutations;
+static uint32_t mutation_count;
+static uint32_t next_mutation;
+static Timer mutation_timer;
+
+static const char *snapshot_path; // NULL when checkpoints are off
+static uint32_t checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+static Timer checkpoint_timer;
+static volatile sig_atomic_t terminate_requested;
+
+// Snapshot mapped at startup. Its sessions are restored one by one, the
+// first time a client asks for them.
+static struct {
+    const uint8_t *data;
+    size_t size;
+    const SnapshotHeader *header; // NULL without a usable snapshot
+    const SnapshotRecord *records;
+    uint8_t *consumed;            // One bit per record already restored or expired
+    uint64_t remaining;
+    uint64_t *positions;          // (cell << 32) | slot of every record, sorted; built on first use
+    uint64_t position_count;
+} restore_source;
+
+// Checkpoint being written, a batch of sessions per pass of the event loop
+static struct {
+    int fd; // -1 when no checkpoint is in progress
+    char path[4096];
+    uint8_t *map; // Header and record table
+    size_t map_size;
+    SnapshotRecord *records;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t flushed_end; // Tiles are appended after the table
+    uint8_t buf[64 * 1024];
+    size_t buf_len;
+    uint32_t phase;
+    uint64_t cursor;
+    time_t started_at;
+} checkpoint = { .fd = -1 };
+
+// Finished checkpoint being synced to disk. msync/fsync of a large file
+// stall for hundreds of milliseconds, so they run on a helper thread that
+// owns the mapping from checkpoint_finish() until it is reaped.
+static struct {
+    pthread_t thread;
+    int running;      // Touched only by the event loop
+    atomic_int done;  // Set by the helper thread when it is over
+    int fd;
+    char path[4096];
+    uint8_t *map;
+    size_t map_size;
+    uint64_t count;
+    const char *error; // NULL when the snapshot was written
+    int error_errno;
+} checkpoint_sync;
+
 // Function prototypes
-void read_matrix_from_file(const char *filename, GameState *gameState);
-void initialize_game(GameState *gameState, const char *filename);
-int handle_client(int client_fd, GameState *gameState, const char *filename);
-void process_action(int client_fd, struct action *act, GameState *gameState, const char *filename);
+void usage(const char *program);
+void read_matrix_from_file(const char *filename, Maze *maze);
+void initialize_game(GameState *gameState);
+void process_action(int client_fd, struct action *act, GameState *gameState);
 void send_action(int client_fd, struct action *act);
 void serialize_action(struct action *act);
 void deserialize_action(struct action *act);
@@ -57,238 +435,2782 @@ void fill_possible_moves(GameState *gameState, struct action *act);
 void init_game_state(GameState *game_state);
 void build_error(struct action *act, const char* msg);
 void reset_game(GameState *gameState);
-void set_matrix_descoberto_to_zeros(GameState *gameState);
 void mark_positions_around_player(GameState *gameState);
+void cast_light(const Shadowcast *sc, int row, double start_slope, double end_slope);
+int is_opaque(int i, int j);
+int maze_cell(int i, int j);
+int is_walkable(int i, int j);
+void board_window(GameState *gameState, int *origin_i, int *origin_j);
+void fill_exit(GameState *gameState, struct action *act);
+
+// Discovered map prototypes
+void discovered_set(DiscoveredMap *map, uint32_t i, uint32_t j);
+int discovered_get(const DiscoveredMap *map, uint32_t i, uint32_t j);
+void discovered_free(DiscoveredMap *map);
+void discovered_merge_tile(DiscoveredMap *map, uint32_t key, const uint64_t *rows);
+
+// Room prototypes
+Room *find_or_create_room(int32_t id);
+void room_enter(Room *room, GameState *gameState);
+void room_leave(GameState *gameState);
+void room_hold(Room *room);
+void room_release(Room *room);
+void room_move(GameState *gameState, uint32_t old_i, uint32_t old_j);
+atomic_uint *room_counter(Room *room, uint32_t i, uint32_t j, int create);
+void fill_nearby_players(GameState *gameState, struct action *act);
+
+// Session parking prototypes
+uint64_t generate_session_token(void);
+void init_parked_sessions(void);
+void park_session(GameState *gameState);
+ParkedSession *park_slot(uint64_t token, time_t now);
+int32_t find_parked_session(uint64_t token);
+int resume_session(uint64_t token, GameState *gameState);
+int take_over_session(uint64_t token, GameState *gameState);
+void expire_parked_sessions(time_t now);
+void unpark_session(int32_t idx);
+void fill_session_token(GameState *gameState, struct action *act);
+
+// Maze mutation prototypes
+void distance_init(void);
+int maze_check_cell(uint32_t i, uint32_t j, int value);
+int maze_set_cell(uint32_t i, uint32_t j, int value);
+uint64_t fingerprint_chain(uint64_t fingerprint, uint64_t change);
+int cell_occupied(uint32_t i, uint32_t j);
+void load_mutation_schedule(const char *filename);
+int compare_mutations(const void *a, const void *b);
+void mutation_expired(Timer *timer);
+
+// Checkpoint prototypes
+void snapshot_open(void);
+int snapshot_restore(uint64_t token);
+int snapshot_occupied(uint32_t cell);
+int compare_positions(const void *a, const void *b);
+void checkpoint_begin(void);
+void checkpoint_step(uint64_t budget);
+void checkpoint_finish(void);
+void checkpoint_abort(const char *what);
+void *checkpoint_sync_thread(void *arg);
+void checkpoint_reap(int wait);
+size_t checkpoint_put(uint64_t token, time_t parked_at, uint32_t player_i, uint32_t player_j,
+                      uint32_t game_over, int32_t room_id, const DiscoveredMap *discovered);
+size_t checkpoint_put_game(GameState *gameState);
+size_t checkpoint_put_parked(ParkedSession *ps);
+void checkpoint_drop(uint64_t token);
+void checkpoint_expired(Timer *timer);
+void terminate_handler(int sig);
+
+// Admission control prototypes
+uint64_t monotonic_us(void);
+int command_class(int type);
+void init_token_buckets(Connection *conn);
+int bucket_take(TokenBucket *bucket, int cls, uint64_t now_us);
+void overload_batch(uint64_t wait_started_us, int events);
+int admit_command(Connection *conn, struct action *act);
+void print_rejections(void);
+void stats_handler(int sig);
+
+// Timer wheel prototypes
+void timer_wheel_init(void);
+void timer_init(Timer *timer, void (*callback)(Timer *timer), void *owner);
+void timer_arm(Timer *timer, uint64_t delay_ticks);
+void timer_cancel(Timer *timer);
+void timer_wheel_advance(uint64_t target);
+uint64_t current_tick(void);
+void housekeeping_expired(Timer *timer);
+
+// Connection prototypes
+void init_connections(void);
+void accept_connections(int server_fd);
+void accept_pause(int err);
+void accept_resume(void);
+void close_connection(Connection *conn);
+void connection_read(Connection *conn);
+void connection_write(Connection *conn, const struct action *act);
+void connection_send_frame(Connection *conn, Frame *frame);
+void connection_flush(Connection *conn);
+void connection_update(Connection *conn);
+void connection_idle_expired(Timer *timer);
+void connection_read_expired(Timer *timer);
+void connection_write_expired(Timer *timer);
+Frame *frame_alloc(void);
+void frame_release(Frame *frame);
+void release_queued_frames(Connection *conn);
+
+// Live session and UDP prototypes
+void live_session_update(Connection *conn);
+Connection *find_live_session(uint64_t token);
+int open_udp_socket(int family, const char *port);
+void udp_receive(void);
+int run_sequenced(Connection *conn, uint32_t sequence, struct action *act, struct action *reply);
+
+// Spectator prototypes
+void spectate_start(Connection *conn, uint64_t token);
+void spectate_stop(Connection *conn);
+void fill_spectator_view(GameState *gameState, struct action *act, int type);
+void publish_to_spectators(int client_fd, GameState *gameState, int type);
 
 // Handler function prototypes
-void handle_start(int client_fd, struct action *act, GameState *gameState, const char *filename);
+void handle_start(int client_fd, struct action *act, GameState *gameState);
 void handle_move(int client_fd, struct action *act, GameState *gameState);
 void handle_map(int client_fd, struct action *act, GameState *gameState);
-void handle_reset(int client_fd, struct action *act, GameState *gameState, const char *filename);
-void handle_exit(int client_fd, struct action *act);
+void handle_reset(int client_fd, struct action *act, GameState *gameState);
+void handle_resume(int client_fd, struct action *act, GameState *gameState);
+void handle_join(int client_fd, struct action *act, GameState *gameState);
+void handle_spectate(int client_fd, struct action *act, GameState *gameState);
+void handle_exit(int client_fd, struct action *act, GameState *gameState);
+void handle_hint(int client_fd, struct action *act, GameState *gameState);
+void handle_mutate(int client_fd, struct action *act);
 void handle_default(int client_fd, struct action *act);
 void handle_game_not_inicialized(int client_fd, struct action *act);
-void handle_game_over(int client_fd, struct action *act, GameState *gameState, const char *filename);
+void handle_game_over(int client_fd, struct action *act, GameState *gameState);
 void handle_commands_game_over(int client_fd, struct action *act);
 
 int main(int argc, char *argv[]) {
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s <v4|v6> <port> -i <input matrix file>\n", argv[0]);
-        exit(EXIT_FAILURE);
+    if (argc < 5) {
+        usage(argv[0]);
     }
 
     char *ip_version = argv[1];
     char *port = argv[2];
     char *input_flag = argv[3];
     char *input_file = argv[4];
+    char *udp_port = NULL;
+    char *schedule_file = NULL;
+
+    if (strcmp(input_flag, "-i") != 0) {
+        usage(argv[0]);
+    }
+
+    // Optional flags
+    for (int k = 5; k < argc; k += 2) {
+        if (k + 1 >= argc) {
+            usage(argv[0]);
+        }
+        if (strcmp(argv[k], "-t") == 0 && atoi(argv[k + 1]) > 0) {
+            session_ttl = atoi(argv[k + 1]);
+        } else if (strcmp(argv[k], "-s") == 0 && atoi(argv[k + 1]) > 0) {
+            max_parked_sessions = atoi(argv[k + 1]);
+        } else if (strcmp(argv[k], "-d") == 0 && atoi(argv[k + 1]) > 0) {
+            idle_timeout = atoi(argv[k + 1]);
+        } else if (strcmp(argv[k], "-r") == 0 && atoi(argv[k + 1]) > 0 && atoi(argv[k + 1]) <= MAX_VISION_RADIUS) {
+            vision_radius = atoi(argv[k + 1]);
+        } else if (strcmp(argv[k], "-u") == 0) {
+            udp_port = argv[k + 1];
+        } else if (strcmp(argv[k], "-a") == 0) {
+            admin_secret = argv[k + 1];
+        } else if (strcmp(argv[k], "-m") == 0) {
+            schedule_file = argv[k + 1];
+        } else if (strcmp(argv[k], "-c") == 0) {
+            snapshot_path = argv[k + 1];
+        } else if (strcmp(argv[k], "-p") == 0 && atoi(argv[k + 1]) > 0) {
+            checkpoint_interval = atoi(argv[k + 1]);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    // The maze is read once and shared by every game
+    read_matrix_from_file(input_file, &maze);
+    init_parked_sessions();
+    distance_init();
+    init_connections();
+    timer_wheel_init();
+    if (schedule_file) {
+        load_mutation_schedule(schedule_file);
+    }
+
+    // Sessions of the previous run come back from the snapshot as clients resume them
+    if (snapshot_path) {
+        snapshot_open();
+        timer_init(&checkpoint_timer, checkpoint_expired, NULL);
+        timer_arm(&checkpoint_timer, SECONDS_TO_TICKS(checkpoint_interval));
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = terminate_handler;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGTERM, &sa, NULL);
+    }
+
+    // Rejection counters are printed on demand
+    struct sigaction stats_sa;
+    memset(&stats_sa, 0, sizeof(stats_sa));
+    stats_sa.sa_handler = stats_handler;
+    sigemptyset(&stats_sa.sa_mask);
+    sigaction(SIGUSR1, &stats_sa, NULL);
+
+    int server_fd;
+    int opt = 1;
+    struct addrinfo hints, *res, *p;
+    int status;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE; // Use the system's IP address
+
+    if (strcmp(ip_version, "v4") == 0) {
+        hints.ai_family = AF_INET;
+    } else if (strcmp(ip_version, "v6") == 0) {
+        hints.ai_family = AF_INET6;
+    } else {
+        fprintf(stderr, "Invalid IP version: %s. Use v4 or v6.\n", ip_version);
+        exit(EXIT_FAILURE);
+    }
+
+    if ((status = getaddrinfo(NULL, port, &hints, &res)) != 0) {
+        fprintf(stderr, "Error in getaddrinfo: %s\n", gai_strerror(status));
+        exit(EXIT_FAILURE);
+    }
+
+    for (p = res; p != NULL; p = p->ai_next) {
+        if ((server_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
+            perror("server: socket");
+            continue;
+        }
+
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt");
+            close(server_fd);
+            continue;
+        }
+
+        if (bind(server_fd, p->ai_addr, p->ai_addrlen) == -1) {
+            close(server_fd);
+            perror("server: bind");
+            continue;
+        }
+
+        break; // Success
+    }
+
+    if (p == NULL) {
+        fprintf(stderr, "server: failed to bind\n");
+        exit(EXIT_FAILURE);
+    }
+
+    freeaddrinfo(res);
+
+    if (listen(server_fd, SOMAXCONN) == -1) {
+        perror("Error in listen");
+        close(server_fd);
+        exit(EXIT_FAILURE);
+    }
+
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+
+    if ((epoll_fd = epoll_create1(0)) == -1) {
+        perror("Error in epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    // The listening socket is the only entry without a connection attached
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) == -1) {
+        perror("Error in epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    listen_fd = server_fd;
+
+    // Optional low-latency transport for MOVE and MAP; sessions still start over TCP
+    if (udp_port) {
+        udp_fd = open_udp_socket(hints.ai_family, udp_port);
+        ev.events = EPOLLIN;
+        ev.data.ptr = &udp_fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, udp_fd, &ev) == -1) {
+            perror("Error in epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        // A checkpoint in progress is written between batches of requests
+        int timeout_ms = checkpoint.fd != -1 ? 0 : TIMER_TICK_MS;
+        uint64_t wait_started_us = monotonic_us();
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+        if (n == -1 && errno != EINTR) {
+            perror("Error in epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+        overload_batch(wait_started_us, n);
+
+        for (int e = 0; e < n; e++) {
+            if (events[e].data.ptr == &udp_fd) {
+                udp_receive();
+                continue;
+            }
+            Connection *conn = events[e].data.ptr;
+            if (conn == NULL) {
+                accept_connections(server_fd);
+                continue;
+            }
+            if (conn->fd == -1) {
+                continue; // Closed earlier in this batch
+            }
+            if (events[e].events & EPOLLOUT) {
+                connection_flush(conn);
+            }
+            if (conn->fd != -1 && (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                connection_read(conn);
+            }
+        }
+
+        timer_wheel_advance(current_tick());
+
+        if (stats_requested) {
+            stats_requested = 0;
+            print_rejections();
+        }
+        if (terminate_requested) {
+            // Save every session before going down. A periodic checkpoint
+            // under way already wrote some games that moved on since, so
+            // it is thrown away and a fresh one written in one go.
+            if (checkpoint.fd != -1) {
+                checkpoint_abort(NULL);
+            }
+            checkpoint_reap(1);
+            checkpoint_begin();
+            while (checkpoint.fd != -1) {
+                checkpoint_step(UINT64_MAX);
+            }
+            checkpoint_reap(1);
+            break;
+        }
+        if (checkpoint.fd != -1) {
+            checkpoint_step(CHECKPOINT_BATCH);
+            // Time spent writing the checkpoint is not time commands spent queueing
+            overload.batch_started_us = monotonic_us();
+        }
+        checkpoint_reap(0);
+    }
+
+    close(server_fd);
+    return 0;
+}
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s <v4|v6> <port> -i <input matrix file> [-t <session ttl seconds>] [-s <max parked sessions>] [-d <idle timeout seconds>] [-r <vision radius>] [-u <udp port>] [-a <admin secret>] [-m <mutation schedule>] [-c <snapshot file> [-p <checkpoint seconds>]]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+void read_matrix_from_file(const char *filename, Maze *maze) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening the file");
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        fprintf(stderr, "Error: The input file is empty or unreadable.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Large mazes are parsed straight from the mapped file, with no line length limit
+    const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("Error mapping the file");
+        exit(EXIT_FAILURE);
+    }
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+    size_t capacity = 1024;
+    size_t count = 0;
+    maze->cells = malloc(capacity);
+    if (!maze->cells) {
+        perror("Error allocating the maze");
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t row = 0;
+    uint32_t col = 0;
+    uint32_t cols_in_first_row = 0;
+    int found_start = 0;
+    const char *end = data + st.st_size;
+
+    for (const char *c = data; c <= end; c++) {
+        if (c == end || *c == '\n') {
+            // Blank lines are skipped; every other line must be as wide as the first
+            if (col > 0) {
+                if (row == 0) {
+                    cols_in_first_row = col;
+                } else if (col != cols_in_first_row) {
+                    fprintf(stderr, "Error: Inconsistent number of columns in line %u.\n", row + 1);
+                    exit(EXIT_FAILURE);
+                }
+                row++;
+                col = 0;
+            }
+            continue;
+        }
+        if (*c == ' ' || *c == '\t' || *c == '\r') {
+            continue;
+        }
+
+        int negative = (*c == '-');
+        if (negative) {
+            c++;
+        }
+        if (c == end || *c < '0' || *c > '9') {
+            fprintf(stderr, "Error: Invalid value in line %u.\n", row + 1);
+            exit(EXIT_FAILURE);
+        }
+        int value = 0;
+        while (c < end && *c >= '0' && *c <= '9' && value <= INT8_MAX) {
+            value = value * 10 + (*c++ - '0');
+        }
+        if (value > INT8_MAX || (c < end && *c != ' ' && *c != '\t' && *c != '\r' && *c != '\n')) {
+            fprintf(stderr, "Error: Invalid value in line %u.\n", row + 1);
+            exit(EXIT_FAILURE);
+        }
+        c--; // The loop steps over the separator
+
+        if (row > 0 && col == cols_in_first_row) {
+            fprintf(stderr, "Error: Inconsistent number of columns in line %u.\n", row + 1);
+            exit(EXIT_FAILURE);
+        }
+        if (value == 2) {
+            maze->inicio_i = row;
+            maze->inicio_j = col;
+            found_start = 1;
+        } else if (value == 3) {
+            maze->fim_i = row;
+            maze->fim_j = col;
+        }
+
+        if (count == capacity) {
+            capacity *= 2;
+            maze->cells = realloc(maze->cells, capacity);
+            if (!maze->cells) {
+                perror("Error allocating the maze");
+                exit(EXIT_FAILURE);
+            }
+        }
+        maze->cells[count++] = (int8_t)(negative ? -value : value);
+        col++;
+    }
+
+    munmap((void *)data, st.st_size);
+    int8_t *fitted = realloc(maze->cells, count ? count : 1);
+    if (fitted) {
+        maze->cells = fitted;
+    }
+
+    if (row == 0 || !found_start) {
+        fprintf(stderr, "Error: The maze has no start position.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (count > UINT32_MAX) {
+        fprintf(stderr, "Error: The maze is too large.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    maze->actual_rows = row;              // Actual number of rows in the map
+    maze->actual_cols = cols_in_first_row; // Actual number of columns in the map
+    maze->tiles_per_row = (maze->actual_cols + TILE_SIZE - 1) >> TILE_BITS;
+    maze->tile_count = maze->tiles_per_row * ((maze->actual_rows + TILE_SIZE - 1) >> TILE_BITS);
+
+    // FNV-1a over the size and the cells, eight cells at a time
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    hash = (hash ^ maze->actual_rows) * 0x100000001B3ULL;
+    hash = (hash ^ maze->actual_cols) * 0x100000001B3ULL;
+    for (size_t k = 0; k < count; k += 8) {
+        uint64_t word = 0;
+        memcpy(&word, maze->cells + k, count - k < 8 ? count - k : 8);
+        hash = (hash ^ word) * 0x100000001B3ULL;
+    }
+    maze->base_fingerprint = hash;
+    maze->fingerprint = hash;
+}
+
+void initialize_game(GameState *gameState) {
+    if (gameState->session_token == 0) {
+        gameState->session_token = generate_session_token();
+    }
+    gameState->player_i = maze.inicio_i;
+    gameState->player_j = maze.inicio_j;
+    discovered_free(&gameState->discovered);
+    mark_positions_around_player(gameState);
+    gameState->game_over = 0; // Initialize the game as not over
+    gameState->game_inicialized = 1; // Set the game as initialized
+    printf("starting new game\n");
+}
+
+void mark_positions_around_player(GameState *gameState) {
+    // Everything in line of sight within the vision radius is discovered.
+    // Each octant is scanned row by row away from the player, and a wall
+    // splits the lit slope range into the parts still visible behind it, so
+    // the cost follows the visible area rather than the radius squared.
+    discovered_set(&gameState->discovered, gameState->player_i, gameState->player_j);
+
+    static const int octants[8][4] = {
+        { 1, 0, 0, -1 }, { 0, 1, -1, 0 }, { 0, 1, 1, 0 }, { 1, 0, 0, 1 },
+        { -1, 0, 0, 1 }, { 0, -1, 1, 0 }, { 0, -1, -1, 0 }, { -1, 0, 0, -1 },
+    };
+    for (int o = 0; o < 8; o++) {
+        Shadowcast sc = { gameState, (int)vision_radius, octants[o][0], octants[o][1], octants[o][2], octants[o][3] };
+        cast_light(&sc, 1, 1.0, 0.0);
+    }
+}
+
+int is_opaque(int i, int j) {
+    int cell = maze_cell(i, j);
+    return cell == 0 || cell == -1;
+}
+
+void cast_light(const Shadowcast *sc, int row, double start_slope, double end_slope) {
+    if (start_slope < end_slope) {
+        return;
+    }
+
+    int radius = sc->radius;
+    double next_start_slope = start_slope;
+
+    for (int distance = row; distance <= radius; distance++) {
+        int blocked = 0;
+        int dy = -distance;
+
+        for (int dx = -distance; dx <= 0; dx++) {
+            int i = (int)sc->gameState->player_i + dx * sc->yx + dy * sc->yy;
+            int j = (int)sc->gameState->player_j + dx * sc->xx + dy * sc->xy;
+            double left_slope = (dx - 0.5) / (dy + 0.5);
+            double right_slope = (dx + 0.5) / (dy - 0.5);
+
+            if (start_slope < right_slope) {
+                continue;
+            } else if (end_slope > left_slope) {
+                break;
+            }
+
+            // r*r + r keeps the diagonal neighbours inside a radius of 1
+            if (dx * dx + dy * dy <= radius * radius + radius && maze_cell(i, j) != -1) {
+                discovered_set(&sc->gameState->discovered, i, j);
+            }
+
+            if (blocked) {
+                if (is_opaque(i, j)) {
+                    next_start_slope = right_slope;
+                    continue;
+                }
+                blocked = 0;
+                start_slope = next_start_slope;
+            } else if (is_opaque(i, j) && distance < radius) {
+                // Light past this wall continues in a narrower scan
+                blocked = 1;
+                cast_light(sc, distance + 1, start_slope, left_slope);
+                next_start_slope = right_slope;
+            }
+        }
+
+        if (blocked) {
+            break;
+        }
+    }
+}
+
+int maze_cell(int i, int j) {
+    // Cells outside the maze read as -1, like the padding of a small board
+    if (i < 0 || j < 0 || i >= (int)maze.actual_rows || j >= (int)maze.actual_cols) {
+        return -1;
+    }
+    return maze.cells[(size_t)i * maze.actual_cols + j];
+}
+
+int is_walkable(int i, int j) {
+    int cell = maze_cell(i, j);
+    return cell != 0 && cell != -1;
+}
+
+static uint32_t tile_of(uint32_t i, uint32_t j) {
+    return (i >> TILE_BITS) * maze.tiles_per_row + (j >> TILE_BITS);
+}
+
+static DiscoveredTile *discovered_find(const DiscoveredMap *map, uint32_t key) {
+    if (map->capacity == 0) {
+        return NULL;
+    }
+    uint32_t slot = (key * 2654435761u) & (map->capacity - 1);
+    while (map->tiles[slot].key != 0) {
+        if (map->tiles[slot].key == key) {
+            return &map->tiles[slot];
+        }
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+    return NULL;
+}
+
+static DiscoveredTile *discovered_insert(DiscoveredTile *tiles, uint32_t capacity, uint32_t key) {
+    uint32_t slot = (key * 2654435761u) & (capacity - 1);
+    while (tiles[slot].key != 0) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    tiles[slot].key = key;
+    return &tiles[slot];
+}
+
+static DiscoveredTile *discovered_tile(DiscoveredMap *map, uint32_t key) {
+    DiscoveredTile *tile = discovered_find(map, key);
+
+    if (!tile) {
+        // Keep the table at most half full so probes stay short
+        if ((map->count + 1) * 2 > map->capacity) {
+            uint32_t capacity = map->capacity ? map->capacity * 2 : 4;
+            DiscoveredTile *tiles = calloc(capacity, sizeof(DiscoveredTile));
+            if (!tiles) {
+                perror("Error allocating the discovered map");
+                exit(EXIT_FAILURE);
+            }
+            for (uint32_t k = 0; k < map->capacity; k++) {
+                if (map->tiles[k].key != 0) {
+                    discovered_insert(tiles, capacity, map->tiles[k].key)->rows = map->tiles[k].rows;
+                }
+            }
+            free(map->tiles);
+            map->tiles = tiles;
+            map->capacity = capacity;
+        }
+
+        tile = discovered_insert(map->tiles, map->capacity, key);
+        tile->rows = calloc(TILE_SIZE, sizeof(uint64_t));
+        if (!tile->rows) {
+            perror("Error allocating the discovered map");
+            exit(EXIT_FAILURE);
+        }
+        map->count++;
+    }
+    return tile;
+}
+
+void discovered_set(DiscoveredMap *map, uint32_t i, uint32_t j) {
+    DiscoveredTile *tile = discovered_tile(map, tile_of(i, j) + 1);
+    tile->rows[i & (TILE_SIZE - 1)] |= (uint64_t)1 << (j & (TILE_SIZE - 1));
+}
+
+void discovered_merge_tile(DiscoveredMap *map, uint32_t key, const uint64_t *rows) {
+    if (key == 0 || key > maze.tile_count) {
+        return;
+    }
+    DiscoveredTile *tile = discovered_tile(map, key);
+    for (int r = 0; r < TILE_SIZE; r++) {
+        tile->rows[r] |= rows[r];
+    }
+}
+
+int discovered_get(const DiscoveredMap *map, uint32_t i, uint32_t j) {
+    DiscoveredTile *tile = discovered_find(map, tile_of(i, j) + 1);
+    return tile && ((tile->rows[i & (TILE_SIZE - 1)] >> (j & (TILE_SIZE - 1))) & 1);
+}
+
+void discovered_free(DiscoveredMap *map) {
+    for (uint32_t k = 0; k < map->capacity; k++) {
+        free(map->tiles[k].rows);
+    }
+    free(map->tiles);
+    map->tiles = NULL;
+    map->capacity = 0;
+    map->count = 0;
+}
+
+Room *find_or_create_room(int32_t id) {
+    Room *free_room = NULL;
+    for (int r = 0; r < MAX_ROOMS; r++) {
+        if (rooms[r].id == id) {
+            return &rooms[r];
+        }
+        if (rooms[r].id == 0 && free_room == NULL) {
+            free_room = &rooms[r];
+        }
+    }
+    if (free_room) {
+        free_room->occupancy = calloc(maze.tile_count, sizeof(*free_room->occupancy));
+        if (!free_room->occupancy) {
+            return NULL;
+        }
+        free_room->id = id;
+    }
+    return free_room;
+}
+
+atomic_uint *room_counter(Room *room, uint32_t i, uint32_t j, int create) {
+    uint32_t tile = tile_of(i, j);
+    atomic_uint *counters = atomic_load_explicit(&room->occupancy[tile], memory_order_acquire);
+
+    if (!counters) {
+        if (!create) {
+            return NULL;
+        }
+        atomic_uint *fresh = calloc(TILE_SIZE * TILE_SIZE, sizeof(atomic_uint));
+        if (!fresh) {
+            perror("Error allocating room counters");
+            exit(EXIT_FAILURE);
+        }
+        // Another player may have installed the tile first; theirs wins
+        if (atomic_compare_exchange_strong_explicit(&room->occupancy[tile], &counters, fresh,
+                                                    memory_order_acq_rel, memory_order_acquire)) {
+            counters = fresh;
+        } else {
+            free(fresh);
+        }
+    }
+
+    return &counters[(i & (TILE_SIZE - 1)) * TILE_SIZE + (j & (TILE_SIZE - 1))];
+}
+
+void room_enter(Room *room, GameState *gameState) {
+    gameState->room = room;
+    room_hold(room);
+    atomic_fetch_add_explicit(room_counter(room, gameState->player_i, gameState->player_j, 1), 1, memory_order_relaxed);
+}
+
+void room_leave(GameState *gameState) {
+    Room *room = gameState->room;
+    if (!room) {
+        return;
+    }
+    gameState->room = NULL;
+
+    atomic_fetch_sub_explicit(room_counter(room, gameState->player_i, gameState->player_j, 1), 1, memory_order_relaxed);
+    room_release(room);
+}
+
+// A room lives while it has players or holds; moving a player within the
+// same room holds it so leaving does not free it on the way
+void room_hold(Room *room) {
+    atomic_fetch_add_explicit(&room->players, 1, memory_order_relaxed);
+}
+
+void room_release(Room *room) {
+    if (atomic_fetch_sub_explicit(&room->players, 1, memory_order_relaxed) == 1) {
+        // Last player out frees the room
+        for (uint32_t t = 0; t < maze.tile_count; t++) {
+            free(atomic_load_explicit(&room->occupancy[t], memory_order_relaxed));
+        }
+        free(room->occupancy);
+        room->occupancy = NULL;
+        room->id = 0;
+    }
+}
+
+void room_move(GameState *gameState, uint32_t old_i, uint32_t old_j) {
+    Room *room = gameState->room;
+    atomic_fetch_sub_explicit(room_counter(room, old_i, old_j, 1), 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(room_counter(room, gameState->player_i, gameState->player_j, 1), 1, memory_order_relaxed);
+}
+
+void fill_nearby_players(GameState *gameState, struct action *act) {
+    int player_i = gameState->player_i;
+    int player_j = gameState->player_j;
+    int origin_i, origin_j;
+    board_window(gameState, &origin_i, &origin_j);
+
+    // Only the cells around the player are looked at, however full the room is
+    for (int i = player_i - PLAYER_SIGHT_RADIUS; i <= player_i + PLAYER_SIGHT_RADIUS; i++) {
+        for (int j = player_j - PLAYER_SIGHT_RADIUS; j <= player_j + PLAYER_SIGHT_RADIUS; j++) {
+            int bi = i - origin_i;
+            int bj = j - origin_j;
+            if (maze_cell(i, j) == -1 || bi < 0 || bj < 0 || bi >= MAX_ROWS || bj >= MAX_COLS) {
+                continue;
+            }
+            if ((i == player_i && j == player_j) || act->board[bi][bj] == 4) {
+                continue;
+            }
+            atomic_uint *counter = room_counter(gameState->room, i, j, 0);
+            if (counter && atomic_load_explicit(counter, memory_order_relaxed) > 0) {
+                act->board[bi][bj] = OTHER_PLAYER;
+            }
+        }
+    }
+}
+
+uint64_t generate_session_token(void) {
+    uint64_t token = 0;
+    // Tokens are the only credential for RESUME, so they must not be guessable
+    while (token == 0) {
+        if (getrandom(&token, sizeof(token), 0) != sizeof(token)) {
+            perror("Error in getrandom");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return token;
+}
+
+static uint32_t session_bucket(uint64_t token) {
+    // Tokens are already random, folding the halves is enough
+    return (uint32_t)(token ^ (token >> 32)) & (SESSION_HASH_BUCKETS - 1);
+}
+
+static uint32_t parked_bucket(uint64_t token) {
+    return (uint32_t)(token ^ (token >> 32)) & parked_bucket_mask;
+}
+
+void init_parked_sessions(void) {
+    // Two buckets per session keeps the chains short at any table size
+    uint32_t buckets = SESSION_HASH_BUCKETS;
+    while (buckets < 2 * (uint64_t)max_parked_sessions) {
+        buckets *= 2;
+    }
+    parked_bucket_mask = buckets - 1;
+    parked_buckets = malloc(buckets * sizeof(int32_t));
+    parked_sessions = calloc(max_parked_sessions, sizeof(ParkedSession));
+    if (!parked_buckets || !parked_sessions) {
+        perror("Error allocating the parked sessions");
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t i = 0; i < buckets; i++) {
+        parked_buckets[i] = -1;
+    }
+    for (uint32_t i = 0; i < max_parked_sessions; i++) {
+        parked_sessions[i].bucket_next = (i + 1 < max_parked_sessions) ? (int32_t)i + 1 : -1;
+    }
+    parked_free = 0;
+    parked_oldest = -1;
+    parked_newest = -1;
+}
+
+void unpark_session(int32_t idx) {
+    ParkedSession *ps = &parked_sessions[idx];
+
+    // Unlink from the hash bucket
+    int32_t *link = &parked_buckets[parked_bucket(ps->token)];
+    while (*link != idx) {
+        link = &parked_sessions[*link].bucket_next;
+    }
+    *link = ps->bucket_next;
+
+    // Unlink from the age list
+    if (ps->age_prev != -1) {
+        parked_sessions[ps->age_prev].age_next = ps->age_next;
+    } else {
+        parked_oldest = ps->age_next;
+    }
+    if (ps->age_next != -1) {
+        parked_sessions[ps->age_next].age_prev = ps->age_prev;
+    } else {
+        parked_newest = ps->age_prev;
+    }
+
+    discovered_free(&ps->discovered);
+    ps->token = 0;
+    ps->bucket_next = parked_free;
+    parked_free = idx;
+}
+
+void expire_parked_sessions(time_t now) {
+    // Every session has the same TTL, so the oldest ones always expire first
+    while (parked_oldest != -1 && now - parked_sessions[parked_oldest].parked_at >= (time_t)session_ttl) {
+        unpark_session(parked_oldest);
+    }
+}
+
+ParkedSession *park_slot(uint64_t token, time_t now) {
+    expire_parked_sessions(now);
+
+    // When full, nobody is evicted before its TTL: the newcomer is refused
+    if (parked_free == -1) {
+        return NULL;
+    }
+
+    int32_t idx = parked_free;
+    ParkedSession *ps = &parked_sessions[idx];
+    parked_free = ps->bucket_next;
+
+    ps->token = token;
+    ps->parked_at = now;
+    memset(&ps->discovered, 0, sizeof(ps->discovered));
+
+    uint32_t bucket = parked_bucket(ps->token);
+    ps->bucket_next = parked_buckets[bucket];
+    parked_buckets[bucket] = idx;
+
+    ps->age_prev = parked_newest;
+    ps->age_next = -1;
+    if (parked_newest != -1) {
+        parked_sessions[parked_newest].age_next = idx;
+    } else {
+        parked_oldest = idx;
+    }
+    parked_newest = idx;
+    return ps;
+}
+
+void park_session(GameState *gameState) {
+    ParkedSession *ps = park_slot(gameState->session_token, time(NULL));
+    if (!ps) {
+        room_leave(gameState);
+        checkpoint_drop(gameState->session_token);
+        fprintf(stderr, "Session dropped: %u sessions already parked\n", max_parked_sessions);
+        return;
+    }
+    ps->player_i = gameState->player_i;
+    ps->player_j = gameState->player_j;
+    ps->game_over = gameState->game_over;
+    ps->room_id = gameState->room ? gameState->room->id : 0;
+    ps->discovered = gameState->discovered;
+    memset(&gameState->discovered, 0, sizeof(gameState->discovered));
+    checkpoint_put_parked(ps);
+
+    room_leave(gameState);
+    printf("session parked\n");
+}
+
+int32_t find_parked_session(uint64_t token) {
+    expire_parked_sessions(time(NULL));
+
+    int32_t idx = parked_buckets[parked_bucket(token)];
+    while (idx != -1 && parked_sessions[idx].token != token) {
+        idx = parked_sessions[idx].bucket_next;
+    }
+
+    // Not seen since the restart: it may still be waiting in the snapshot
+    if (idx == -1 && snapshot_restore(token)) {
+        idx = parked_newest;
+    }
+    return idx;
+}
+
+int resume_session(uint64_t token, GameState *gameState) {
+    if (token == 0) {
+        return 0;
+    }
+    int32_t idx = find_parked_session(token);
+    if (idx == -1) {
+        return 0;
+    }
+
+    ParkedSession *ps = &parked_sessions[idx];
+    gameState->session_token = token;
+    gameState->game_inicialized = 1;
+    gameState->game_over = ps->game_over;
+    gameState->player_i = ps->player_i;
+    gameState->player_j = ps->player_j;
+
+    discovered_free(&gameState->discovered);
+    gameState->discovered = ps->discovered;
+    memset(&ps->discovered, 0, sizeof(ps->discovered));
+
+    // Back into the room it was playing in; solo if the room table is full
+    if (ps->room_id != 0) {
+        Room *room = find_or_create_room(ps->room_id);
+        if (room) {
+            room_enter(room, gameState);
+        }
+    }
+
+    unpark_session(idx);
+    checkpoint_put_game(gameState);
+    return 1;
+}
+
+void fill_session_token(GameState *gameState, struct action *act) {
+    act->session_token[0] = (uint32_t)(gameState->session_token >> 32);
+    act->session_token[1] = (uint32_t)gameState->session_token;
+}
+
+void live_session_update(Connection *conn) {
+    uint64_t token = conn->gameState.game_inicialized ? conn->gameState.session_token : 0;
+    if (token == conn->indexed_token) {
+        return;
+    }
+
+    if (conn->indexed_token != 0) {
+        Connection **link = &live_sessions[session_bucket(conn->indexed_token)];
+        while (*link != conn) {
+            link = &(*link)->live_next;
+        }
+        *link = conn->live_next;
+    }
+
+    // A different session starts over with UDP sequence numbers
+    conn->indexed_token = token;
+    conn->udp_sequence = 0;
+    if (conn->udp_reply) {
+        frame_release(conn->udp_reply);
+        conn->udp_reply = NULL;
+    }
+
+    if (token != 0) {
+        uint32_t bucket = session_bucket(token);
+        conn->live_next = live_sessions[bucket];
+        live_sessions[bucket] = conn;
+    }
+}
+
+int take_over_session(uint64_t token, GameState *gameState) {
+    // The client reconnected before the server noticed the old connection
+    // was dead (half-open TCP): the game moves over and the old one is closed
+    Connection *stale = find_live_session(token);
+    if (!stale || &stale->gameState == gameState) {
+        return 0;
+    }
+
+    GameState *old = &stale->gameState;
+    int32_t room_id = old->room ? old->room->id : 0;
+    room_leave(old);
+
+    gameState->session_token = token;
+    gameState->game_inicialized = 1;
+    gameState->game_over = old->game_over;
+    gameState->player_i = old->player_i;
+    gameState->player_j = old->player_j;
+
+    discovered_free(&gameState->discovered);
+    gameState->discovered = old->discovered;
+    memset(&old->discovered, 0, sizeof(old->discovered));
+    old->game_inicialized = 0;
+    live_session_update(stale);
+    close_connection(stale);
+
+    if (room_id != 0) {
+        Room *room = find_or_create_room(room_id);
+        if (room) {
+            room_enter(room, gameState);
+        }
+    }
+
+    checkpoint_put_game(gameState);
+    return 1;
+}
+
+Connection *find_live_session(uint64_t token) {
+    Connection *conn = live_sessions[session_bucket(token)];
+    while (conn && conn->indexed_token != token) {
+        conn = conn->live_next;
+    }
+    return token != 0 ? conn : NULL;
+}
+
+int open_udp_socket(int family, const char *port) {
+    struct addrinfo hints, *res, *p;
+    int fd = -1;
+    int status;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if ((status = getaddrinfo(NULL, port, &hints, &res)) != 0) {
+        fprintf(stderr, "Error in getaddrinfo: %s\n", gai_strerror(status));
+        exit(EXIT_FAILURE);
+    }
+
+    for (p = res; p != NULL; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
+            perror("server: udp socket");
+            continue;
+        }
+        if (bind(fd, p->ai_addr, p->ai_addrlen) == -1) {
+            close(fd);
+            perror("server: udp bind");
+            continue;
+        }
+        break;
+    }
+
+    if (p == NULL) {
+        fprintf(stderr, "server: failed to bind udp port\n");
+        exit(EXIT_FAILURE);
+    }
+    freeaddrinfo(res);
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+void udp_receive(void) {
+    struct datagram in[UDP_BATCH];
+    struct datagram out[UDP_BATCH];
+    struct sockaddr_storage addrs[UDP_BATCH];
+    struct iovec in_iov[UDP_BATCH];
+    struct iovec out_iov[UDP_BATCH];
+    struct mmsghdr in_msgs[UDP_BATCH];
+    struct mmsghdr out_msgs[UDP_BATCH];
+
+    memset(in_msgs, 0, sizeof(in_msgs));
+    for (int k = 0; k < UDP_BATCH; k++) {
+        in_iov[k].iov_base = &in[k];
+        in_iov[k].iov_len = sizeof(struct datagram);
+        in_msgs[k].msg_hdr.msg_iov = &in_iov[k];
+        in_msgs[k].msg_hdr.msg_iovlen = 1;
+        in_msgs[k].msg_hdr.msg_name = &addrs[k];
+        in_msgs[k].msg_hdr.msg_namelen = sizeof(addrs[k]);
+    }
+
+    int received = recvmmsg(udp_fd, in_msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+    if (received <= 0) {
+        return;
+    }
+
+    int replies = 0;
+    memset(out_msgs, 0, sizeof(out_msgs));
+    for (int k = 0; k < received; k++) {
+        if (in_msgs[k].msg_len != sizeof(struct datagram)) {
+            continue; // Not one of ours
+        }
+
+        struct datagram *request = &in[k];
+        struct datagram *reply = &out[replies];
+        uint32_t sequence = ntohl(request->sequence);
+        deserialize_action(&request->act);
+
+        // The session token is the credential; unknown ones get no answer at all
+        uint64_t token = ((uint64_t)request->act.session_token[0] << 32) | request->act.session_token[1];
+        Connection *conn = find_live_session(token);
+        if (!conn || !run_sequenced(conn, sequence, &request->act, &reply->act)) {
+            continue;
+        }
+
+        reply->sequence = htonl(sequence);
+        out_iov[replies].iov_base = reply;
+        out_iov[replies].iov_len = sizeof(struct datagram);
+        out_msgs[replies].msg_hdr.msg_iov = &out_iov[replies];
+        out_msgs[replies].msg_hdr.msg_iovlen = 1;
+        out_msgs[replies].msg_hdr.msg_name = &addrs[k];
+        out_msgs[replies].msg_hdr.msg_namelen = in_msgs[k].msg_hdr.msg_namelen;
+        replies++;
+    }
+
+    // Lost replies are recovered by the client retransmitting
+    if (replies > 0) {
+        sendmmsg(udp_fd, out_msgs, replies, MSG_DONTWAIT);
+    }
+}
+
+// Runs a command numbered by the client at most once, however many times it
+// arrives and over either transport. The serialized answer goes to reply.
+// Returns 0 for an old number, which gets no answer.
+int run_sequenced(Connection *conn, uint32_t sequence, struct action *act, struct action *reply) {
+    if (sequence == 0 || sequence < conn->udp_sequence) {
+        return 0;
+    }
+
+    if (sequence == conn->udp_sequence) {
+        // Retransmission: answer again without applying the command twice
+        if (!conn->udp_reply) {
+            return 0;
+        }
+        memcpy(reply, conn->udp_reply->data, sizeof(struct action));
+        return 1;
+    }
+
+    if (!admit_command(conn, act)) {
+        // Refusals are not remembered, so a retransmission is judged again
+        serialize_action(act);
+        memcpy(reply, act, sizeof(struct action));
+        return 1;
+    }
+
+    if (act->type == MOVE || act->type == MAP) {
+        udp_reply = reply;
+        process_action(UDP_CLIENT_FD, act, &conn->gameState);
+        udp_reply = NULL;
+    } else {
+        build_error(act, "error: only move and map are accepted over udp");
+        serialize_action(act);
+        memcpy(reply, act, sizeof(struct action));
+    }
+
+    conn->udp_sequence = sequence;
+    if (!conn->udp_reply) {
+        conn->udp_reply = frame_alloc();
+    }
+    memcpy(conn->udp_reply->data, reply, sizeof(struct action));
+    timer_arm(&conn->idle_timer, SECONDS_TO_TICKS(idle_timeout));
+    return 1;
+}
+
+void spectate_start(Connection *conn, uint64_t token) {
+    uint32_t bucket = session_bucket(token);
+    conn->spectating = token;
+    conn->spectate_prev = NULL;
+    conn->spectate_next = spectators[bucket];
+    if (spectators[bucket]) {
+        spectators[bucket]->spectate_prev = conn;
+    }
+    spectators[bucket] = conn;
+}
+
+void spectate_stop(Connection *conn) {
+    if (conn->spectating == 0) {
+        return;
+    }
+    if (conn->spectate_prev) {
+        conn->spectate_prev->spectate_next = conn->spectate_next;
+    } else {
+        spectators[session_bucket(conn->spectating)] = conn->spectate_next;
+    }
+    if (conn->spectate_next) {
+        conn->spectate_next->spectate_prev = conn->spectate_prev;
+    }
+    conn->spectating = 0;
+}
+
+void fill_spectator_view(GameState *gameState, struct action *act, int type) {
+    memset(act, 0, sizeof(struct action));
+    act->type = type;
+    copy_board_to_action(gameState, act);
+    if (type == WIN) {
+        fill_exit(gameState, act);
+    } else {
+        fill_unreachable_positions(gameState, act);
+        if (gameState->room) {
+            fill_nearby_players(gameState, act);
+        }
+        fill_possible_moves(gameState, act);
+    }
+    fill_session_token(gameState, act);
+}
+
+void publish_to_spectators(int client_fd, GameState *gameState, int type) {
+    uint64_t token = gameState->session_token;
+
+    // Games nobody watches never pay for encoding a frame
+    Connection *spectator = spectators[session_bucket(token)];
+    while (spectator && spectator->spectating != token) {
+        spectator = spectator->spectate_next;
+    }
+    if (!spectator) {
+        return;
+    }
+
+    // Encode the board once; every spectator gets a reference to the same frame
+    Frame *frame = frame_alloc();
+    struct action *act = (struct action *)frame->data;
+    fill_spectator_view(gameState, act, type);
+    serialize_action(act);
+
+    while (spectator) {
+        Connection *next = spectator->spectate_next;
+        if (spectator->spectating == token) {
+            connection_send_frame(spectator, frame);
+            timer_arm(&spectator->idle_timer, SECONDS_TO_TICKS(idle_timeout));
+            // The player's own connection is updated once its command is done
+            if (spectator->fd != client_fd) {
+                connection_update(spectator);
+            }
+        }
+        spectator = next;
+    }
+
+    frame_release(frame);
+}
+
+static void queue_push(CellQueue *queue, uint32_t cell) {
+    if (queue->len == queue->capacity) {
+        uint32_t capacity = queue->capacity ? queue->capacity * 2 : 1024;
+        uint32_t *items = malloc((size_t)capacity * sizeof(uint32_t));
+        if (!items) {
+            perror("Error allocating the path queue");
+            exit(EXIT_FAILURE);
+        }
+        for (uint32_t k = 0; k < queue->len; k++) {
+            items[k] = queue->items[(queue->head + k) & (queue->capacity - 1)];
+        }
+        free(queue->items);
+        queue->items = items;
+        queue->capacity = capacity;
+        queue->head = 0;
+    }
+    queue->items[(queue->head + queue->len++) & (queue->capacity - 1)] = cell;
+}
+
+static uint32_t queue_pop(CellQueue *queue) {
+    uint32_t cell = queue->items[queue->head];
+    queue->head = (queue->head + 1) & (queue->capacity - 1);
+    queue->len--;
+    return cell;
+}
+
+static void heap_push(uint32_t distance, uint32_t cell) {
+    if (repair_heap.len == repair_heap.capacity) {
+        uint32_t capacity = repair_heap.capacity ? repair_heap.capacity * 2 : 1024;
+        HeapEntry *entries = realloc(repair_heap.entries, (size_t)capacity * sizeof(HeapEntry));
+        if (!entries) {
+            perror("Error allocating the path heap");
+            exit(EXIT_FAILURE);
+        }
+        repair_heap.entries = entries;
+        repair_heap.capacity = capacity;
+    }
+
+    uint32_t k = repair_heap.len++;
+    while (k > 0 && repair_heap.entries[(k - 1) / 2].distance > distance) {
+        repair_heap.entries[k] = repair_heap.entries[(k - 1) / 2];
+        k = (k - 1) / 2;
+    }
+    repair_heap.entries[k] = (HeapEntry){ distance, cell };
+}
+
+static HeapEntry heap_pop(void) {
+    HeapEntry top = repair_heap.entries[0];
+    HeapEntry last = repair_heap.entries[--repair_heap.len];
+
+    uint32_t k = 0;
+    while (2 * k + 1 < repair_heap.len) {
+        uint32_t child = 2 * k + 1;
+        if (child + 1 < repair_heap.len && repair_heap.entries[child + 1].distance < repair_heap.entries[child].distance) {
+            child++;
+        }
+        if (repair_heap.entries[child].distance >= last.distance) {
+            break;
+        }
+        repair_heap.entries[k] = repair_heap.entries[child];
+        k = child;
+    }
+    if (repair_heap.len > 0) {
+        repair_heap.entries[k] = last;
+    }
+    return top;
+}
+
+static int cell_neighbours(uint32_t cell, uint32_t out[4]) {
+    uint32_t cols = maze.actual_cols;
+    uint32_t i = cell / cols;
+    uint32_t j = cell % cols;
+    int n = 0;
+    if (i > 0) {
+        out[n++] = cell - cols;
+    }
+    if (j + 1 < cols) {
+        out[n++] = cell + 1;
+    }
+    if (i + 1 < maze.actual_rows) {
+        out[n++] = cell + cols;
+    }
+    if (j > 0) {
+        out[n++] = cell - 1;
+    }
+    return n;
+}
+
+static int cell_walkable(uint32_t cell) {
+    return maze.cells[cell] != 0 && maze.cells[cell] != -1;
+}
+
+static void distance_spread(CellQueue *queue) {
+    // Breadth-first from cells whose distance just dropped, stopping
+    // wherever the old distance was already as good
+    uint32_t neighbours[4];
+    while (queue->len > 0) {
+        uint32_t cell = queue_pop(queue);
+        int n = cell_neighbours(cell, neighbours);
+        for (int k = 0; k < n; k++) {
+            if (cell_walkable(neighbours[k]) && distance_to_exit[neighbours[k]] > distance_to_exit[cell] + 1) {
+                distance_to_exit[neighbours[k]] = distance_to_exit[cell] + 1;
+                queue_push(queue, neighbours[k]);
+            }
+        }
+    }
+}
+
+void distance_init(void) {
+    size_t cells = (size_t)maze.actual_rows * maze.actual_cols;
+    distance_to_exit = malloc(cells * sizeof(uint32_t));
+    if (!distance_to_exit) {
+        perror("Error allocating the distance field");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t k = 0; k < cells; k++) {
+        distance_to_exit[k] = DISTANCE_UNREACHABLE;
+    }
+
+    // One full breadth-first search at startup; mutations only repair it
+    uint32_t exit_cell = maze.fim_i * maze.actual_cols + maze.fim_j;
+    if (maze.cells[exit_cell] == 3) {
+        distance_to_exit[exit_cell] = 0;
+        queue_push(&repair_queue, exit_cell);
+        distance_spread(&repair_queue);
+    }
+}
+
+static void distance_open(uint32_t cell) {
+    uint32_t neighbours[4];
+    int n = cell_neighbours(cell, neighbours);
+    for (int k = 0; k < n; k++) {
+        if (distance_to_exit[neighbours[k]] != DISTANCE_UNREACHABLE &&
+            distance_to_exit[neighbours[k]] + 1 < distance_to_exit[cell]) {
+            distance_to_exit[cell] = distance_to_exit[neighbours[k]] + 1;
+        }
+    }
+
+    // Only cells that get closer to the exit through the opening are visited
+    if (distance_to_exit[cell] != DISTANCE_UNREACHABLE) {
+        queue_push(&repair_queue, cell);
+        distance_spread(&repair_queue);
+    }
+}
+
+static void distance_close(uint32_t cell) {
+    uint32_t old = distance_to_exit[cell];
+    distance_to_exit[cell] = DISTANCE_UNREACHABLE;
+    if (old == DISTANCE_UNREACHABLE) {
+        return;
+    }
+
+    // First find the cells that lost every shortest path. They are visited
+    // in order of distance, so by the time a cell is checked, all of its
+    // possible supporters one step closer to the exit are final.
+    uint32_t neighbours[4];
+    int n = cell_neighbours(cell, neighbours);
+    for (int k = 0; k < n; k++) {
+        if (distance_to_exit[neighbours[k]] == old + 1) {
+            queue_push(&repair_queue, neighbours[k]);
+        }
+    }
+    while (repair_queue.len > 0) {
+        uint32_t current = queue_pop(&repair_queue);
+        uint32_t distance = distance_to_exit[current];
+        if (distance == DISTANCE_UNREACHABLE) {
+            continue; // Reached twice
+        }
+
+        int supported = 0;
+        n = cell_neighbours(current, neighbours);
+        for (int k = 0; k < n && !supported; k++) {
+            supported = distance_to_exit[neighbours[k]] != DISTANCE_UNREACHABLE &&
+                        distance_to_exit[neighbours[k]] + 1 == distance;
+        }
+        if (supported) {
+            continue;
+        }
+
+        distance_to_exit[current] = DISTANCE_UNREACHABLE;
+        queue_push(&repair_affected, current);
+        for (int k = 0; k < n; k++) {
+            if (distance_to_exit[neighbours[k]] == distance + 1) {
+                queue_push(&repair_queue, neighbours[k]);
+            }
+        }
+    }
+
+    // Then give them the best distance through the unaffected cells around
+    // them and settle the rest in distance order. Cells cut off from the
+    // exit stay unreachable.
+    while (repair_affected.len > 0) {
+        uint32_t current = queue_pop(&repair_affected);
+        n = cell_neighbours(current, neighbours);
+        for (int k = 0; k < n; k++) {
+            if (distance_to_exit[neighbours[k]] != DISTANCE_UNREACHABLE &&
+                distance_to_exit[neighbours[k]] + 1 < distance_to_exit[current]) {
+                distance_to_exit[current] = distance_to_exit[neighbours[k]] + 1;
+            }
+        }
+        if (distance_to_exit[current] != DISTANCE_UNREACHABLE) {
+            heap_push(distance_to_exit[current], current);
+        }
+    }
+    while (repair_heap.len > 0) {
+        HeapEntry entry = heap_pop();
+        if (entry.distance != distance_to_exit[entry.cell]) {
+            continue; // Improved after it was queued
+        }
+        n = cell_neighbours(entry.cell, neighbours);
+        for (int k = 0; k < n; k++) {
+            if (cell_walkable(neighbours[k]) && distance_to_exit[neighbours[k]] > entry.distance + 1) {
+                distance_to_exit[neighbours[k]] = entry.distance + 1;
+                heap_push(entry.distance + 1, neighbours[k]);
+            }
+        }
+    }
+}
+
+int maze_check_cell(uint32_t i, uint32_t j, int value) {
+    // 1 if the change would apply, 0 if the cell already has that value,
+    // -1 if it is not a valid change and -2 if it would wall in a player
+    if (i >= maze.actual_rows || j >= maze.actual_cols || (value != 0 && value != 1)) {
+        return -1;
+    }
+    uint32_t cell = i * maze.actual_cols + j;
+    if (maze.cells[cell] == 2 || maze.cells[cell] == 3 || maze.cells[cell] == -1) {
+        return -1; // Start and exit stay put
+    }
+    if (maze.cells[cell] == value) {
+        return 0;
+    }
+    if (value == 0 && cell_occupied(i, j)) {
+        return -2;
+    }
+    return 1;
+}
+
+int maze_set_cell(uint32_t i, uint32_t j, int value) {
+    int result = maze_check_cell(i, j, value);
+    if (result != 1) {
+        return result;
+    }
+
+    // Everything runs between two commands, so every session sees either
+    // the old maze or the new one, never a half-repaired distance field
+    uint32_t cell = i * maze.actual_cols + j;
+    maze.cells[cell] = (int8_t)value;
+    if (value == 0) {
+        distance_close(cell);
+    } else {
+        distance_open(cell);
+    }
+
+    // Snapshots carry the changes so a restart can rebuild this maze
+    uint64_t change = ((uint64_t)cell << 1) | (uint64_t)value;
+    if (maze_change_count == maze_change_capacity) {
+        maze_change_capacity = maze_change_capacity ? 2 * maze_change_capacity : 64;
+        maze_changes = realloc(maze_changes, maze_change_capacity * sizeof(uint64_t));
+        if (!maze_changes) {
+            perror("Error recording the maze change");
+            exit(EXIT_FAILURE);
+        }
+    }
+    maze_changes[maze_change_count++] = change;
+    maze.fingerprint = fingerprint_chain(maze.fingerprint, change);
+    return 1;
+}
+
+uint64_t fingerprint_chain(uint64_t fingerprint, uint64_t change) {
+    return (fingerprint ^ change) * 0x100000001B3ULL;
+}
+
+int cell_occupied(uint32_t i, uint32_t j) {
+    // Live games and parked sessions alike; a room's counters only know its own players
+    for (int c = 0; c < MAX_CONNECTIONS; c++) {
+        GameState *gameState = &connections[c].gameState;
+        if (connections[c].fd != -1 && gameState->game_inicialized &&
+            gameState->player_i == i && gameState->player_j == j) {
+            return 1;
+        }
+    }
+    for (uint32_t p = 0; p < max_parked_sessions; p++) {
+        if (parked_sessions[p].token != 0 && parked_sessions[p].player_i == i && parked_sessions[p].player_j == j) {
+            return 1;
+        }
+    }
+    // And sessions that have not come back since the restart yet
+    return snapshot_occupied(i * maze.actual_cols + j);
+}
+
+void load_mutation_schedule(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        perror("Error opening the mutation schedule");
+        exit(EXIT_FAILURE);
+    }
+
+    // One change per line: <seconds after startup> <row> <column> <0 wall | 1 path>
+    uint32_t capacity = 0;
+    unsigned int seconds, i, j;
+    int value;
+    while (fscanf(file, "%u %u %u %d", &seconds, &i, &j, &value) == 4) {
+        if (mutation_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            mutations = realloc(mutations, capacity * sizeof(ScheduledMutation));
+            if (!mutations) {
+                perror("Error allocating the mutation schedule");
+                exit(EXIT_FAILURE);
+            }
+        }
+        mutations[mutation_count++] = (ScheduledMutation){ SECONDS_TO_TICKS(seconds), i, j, value };
+    }
+    if (!feof(file)) {
+        fprintf(stderr, "Error: Invalid line %u in the mutation schedule.\n", mutation_count + 1);
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+
+    qsort(mutations, mutation_count, sizeof(ScheduledMutation), compare_mutations);
+    timer_init(&mutation_timer, mutation_expired, NULL);
+    if (mutation_count > 0) {
+        timer_arm(&mutation_timer, mutations[0].due_tick);
+    }
+}
+
+int compare_mutations(const void *a, const void *b) {
+    const ScheduledMutation *x = a;
+    const ScheduledMutation *y = b;
+    return (x->due_tick > y->due_tick) - (x->due_tick < y->due_tick);
+}
+
+void mutation_expired(Timer *timer) {
+    // Changes due on the same tick are applied together
+    while (next_mutation < mutation_count && mutations[next_mutation].due_tick <= timer_wheel.now) {
+        ScheduledMutation *m = &mutations[next_mutation++];
+        if (maze_set_cell(m->i, m->j, m->value) < 0) {
+            fprintf(stderr, "Ignoring scheduled change of cell %u %u\n", m->i, m->j);
+        }
+    }
+    if (next_mutation < mutation_count) {
+        timer_arm(timer, mutations[next_mutation].due_tick - timer_wheel.now);
+    }
+}
+
+static uint64_t snapshot_slot(uint64_t token, uint64_t capacity) {
+    return ((token * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
+}
+
+void snapshot_open(void) {
+    int fd = open(snapshot_path, O_RDONLY);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            perror("Error opening the snapshot");
+        }
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        fprintf(stderr, "Ignoring snapshot %s: file too short\n", snapshot_path);
+        close(fd);
+        return;
+    }
+
+    // Mapping is all the startup work; sessions are read when first asked for
+    const uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("Error mapping the snapshot");
+        return;
+    }
+
+    const SnapshotHeader *header = (const SnapshotHeader *)data;
+    const char *problem = NULL;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 || header->version != SNAPSHOT_VERSION ||
+        header->record_size != sizeof(SnapshotRecord)) {
+        problem = "not a complete snapshot of this version";
+    } else if (header->base_fingerprint != maze.fingerprint) {
+        problem = "taken with another maze";
+    } else if (header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0 ||
+               header->capacity > (st.st_size - sizeof(SnapshotHeader)) / sizeof(SnapshotRecord)) {
+        problem = "corrupt record table";
+    } else if (header->changes_offset > (uint64_t)st.st_size ||
+               header->change_count > (st.st_size - header->changes_offset) / sizeof(uint64_t)) {
+        problem = "corrupt change list";
+    } else {
+        // The changes must lead from the maze file to the snapshot's maze
+        const uint64_t *changes = (const uint64_t *)(data + header->changes_offset);
+        uint64_t fingerprint = maze.fingerprint;
+        for (uint64_t c = 0; c < header->change_count; c++) {
+            fingerprint = fingerprint_chain(fingerprint, changes[c]);
+        }
+        if (fingerprint != header->maze_fingerprint) {
+            problem = "corrupt change list";
+        }
+    }
+    if (!problem) {
+        // Replayed before any session is back, so nothing stands in the way
+        const uint64_t *changes = (const uint64_t *)(data + header->changes_offset);
+        for (uint64_t c = 0; c < header->change_count && !problem; c++) {
+            uint64_t cell = changes[c] >> 1;
+            if (cell >= (uint64_t)maze.actual_rows * maze.actual_cols ||
+                maze_set_cell(cell / maze.actual_cols, cell % maze.actual_cols, (int)(changes[c] & 1)) != 1) {
+                problem = "change list does not apply to this maze";
+            }
+        }
+        if (header->change_count > 0) {
+            printf("snapshot replayed %llu maze changes\n", (unsigned long long)header->change_count);
+        }
+    }
+    if (problem) {
+        fprintf(stderr, "Ignoring snapshot %s: %s\n", snapshot_path, problem);
+        munmap((void *)data, st.st_size);
+        return;
+    }
+
+    restore_source.consumed = calloc(header->capacity / 8 + 1, 1);
+    if (!restore_source.consumed) {
+        perror("Error allocating the snapshot index");
+        munmap((void *)data, st.st_size);
+        return;
+    }
+    madvise((void *)data, st.st_size, MADV_RANDOM);
+    restore_source.data = data;
+    restore_source.size = st.st_size;
+    restore_source.header = header;
+    restore_source.records = (const SnapshotRecord *)(data + sizeof(SnapshotHeader));
+    restore_source.remaining = header->records;
+    printf("snapshot mapped: %llu sessions to restore\n", (unsigned long long)header->records);
+}
+
+static int snapshot_expired(const SnapshotRecord *record, time_t now) {
+    return now - (time_t)record->parked_at >= (time_t)session_ttl;
+}
+
+int snapshot_restore(uint64_t token) {
+    if (!restore_source.header || token == 0) {
+        return 0;
+    }
+    // Left in the snapshot, still unconsumed, until a parked slot frees up
+    if (parked_free == -1) {
+        return 0;
+    }
+
+    uint64_t capacity = restore_source.header->capacity;
+    uint64_t slot = snapshot_slot(token, capacity);
+    while (restore_source.records[slot].token != token) {
+        if (restore_source.records[slot].token == 0) {
+            return 0;
+        }
+        slot = (slot + 1) & (capacity - 1);
+    }
+
+    // Each record is restored at most once; after that the live copy rules
+    if (restore_source.consumed[slot / 8] & (1u << (slot % 8))) {
+        return 0;
+    }
+    restore_source.consumed[slot / 8] |= (uint8_t)(1u << (slot % 8));
+    restore_source.remaining--;
+
+    const SnapshotRecord *record = &restore_source.records[slot];
+    time_t now = time(NULL);
+    if (snapshot_expired(record, now) ||
+        record->tiles_offset + (uint64_t)record->tile_count * sizeof(SnapshotTile) > restore_source.size) {
+        return 0;
+    }
+
+    // The file is not trusted: the player must stand on an open cell of this maze
+    if (record->player_i >= maze.actual_rows || record->player_j >= maze.actual_cols ||
+        !is_walkable(record->player_i, record->player_j)) {
+        fprintf(stderr, "Ignoring snapshot session: position outside the open maze\n");
+        return 0;
+    }
+
+    // Restored sessions are parked like any dropped one, with a fresh TTL
+    ParkedSession *ps = park_slot(token, now);
+    ps->player_i = record->player_i;
+    ps->player_j = record->player_j;
+    ps->game_over = record->game_over;
+    ps->room_id = record->room_id;
+    const SnapshotTile *tiles = (const SnapshotTile *)(restore_source.data + record->tiles_offset);
+    for (uint32_t t = 0; t < record->tile_count; t++) {
+        discovered_merge_tile(&ps->discovered, tiles[t].key, tiles[t].rows);
+    }
+    printf("session restored from snapshot\n");
+    return 1;
+}
+
+int snapshot_occupied(uint32_t cell) {
+    if (!restore_source.header || restore_source.remaining == 0) {
+        return 0;
+    }
+
+    // Cells are looked up only when a wall goes up, so the index waits for the first one
+    if (!restore_source.positions) {
+        uint64_t capacity = restore_source.header->capacity;
+        uint64_t records = restore_source.header->records < capacity ? restore_source.header->records : capacity;
+        restore_source.positions = malloc(records * sizeof(uint64_t) + 1);
+        if (!restore_source.positions) {
+            perror("Error indexing the snapshot");
+            return 1; // Better to refuse the wall than to bury someone
+        }
+        uint64_t count = 0;
+        for (uint64_t slot = 0; slot < capacity && count < records; slot++) {
+            const SnapshotRecord *record = &restore_source.records[slot];
+            if (record->token != 0 && record->player_i < maze.actual_rows && record->player_j < maze.actual_cols) {
+                uint64_t position = (uint64_t)record->player_i * maze.actual_cols + record->player_j;
+                restore_source.positions[count++] = (position << 32) | slot;
+            }
+        }
+        qsort(restore_source.positions, count, sizeof(uint64_t), compare_positions);
+        restore_source.position_count = count;
+    }
+
+    // First entry for the cell, then every record standing on it
+    uint64_t low = 0;
+    uint64_t high = restore_source.position_count;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        if ((restore_source.positions[mid] >> 32) < cell) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    time_t now = time(NULL);
+    for (uint64_t k = low; k < restore_source.position_count && (restore_source.positions[k] >> 32) == cell; k++) {
+        uint64_t slot = restore_source.positions[k] & 0xFFFFFFFFu;
+        if (!(restore_source.consumed[slot / 8] & (1u << (slot % 8))) &&
+            !snapshot_expired(&restore_source.records[slot], now)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int compare_positions(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+void checkpoint_begin(void) {
+    // The previous snapshot must be on disk before the next one starts
+    checkpoint_reap(0);
+    if (checkpoint.fd != -1 || checkpoint_sync.running) {
+        return;
+    }
+
+    // Size the table for everything that may end up in it, at most half full
+    uint64_t sessions = restore_source.remaining + max_parked_sessions + MAX_CONNECTIONS;
+    uint64_t capacity = 64;
+    while (capacity < sessions * 2) {
+        capacity *= 2;
+    }
+    size_t map_size = sizeof(SnapshotHeader) + capacity * sizeof(SnapshotRecord);
+
+    snprintf(checkpoint.path, sizeof(checkpoint.path), "%s.tmp", snapshot_path);
+    int fd = open(checkpoint.path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        perror("Error creating the checkpoint");
+        return;
+    }
+    if (ftruncate(fd, map_size) == -1) {
+        perror("Error sizing the checkpoint");
+        close(fd);
+        unlink(checkpoint.path);
+        return;
+    }
+    uint8_t *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Error mapping the checkpoint");
+        close(fd);
+        unlink(checkpoint.path);
+        return;
+    }
+
+    checkpoint.fd = fd;
+    checkpoint.map = map;
+    checkpoint.map_size = map_size;
+    checkpoint.records = (SnapshotRecord *)(map + sizeof(SnapshotHeader));
+    checkpoint.capacity = capacity;
+    checkpoint.count = 0;
+    checkpoint.flushed_end = map_size;
+    checkpoint.buf_len = 0;
+    checkpoint.phase = 0;
+    checkpoint.cursor = 0;
+    checkpoint.started_at = time(NULL);
+}
+
+void checkpoint_abort(const char *what) {
+    if (what) {
+        perror(what);
+    }
+    munmap(checkpoint.map, checkpoint.map_size);
+    close(checkpoint.fd);
+    unlink(checkpoint.path);
+    checkpoint.fd = -1;
+}
+
+static int checkpoint_flush(void) {
+    size_t done = 0;
+    while (done < checkpoint.buf_len) {
+        ssize_t n = pwrite(checkpoint.fd, checkpoint.buf + done, checkpoint.buf_len - done, checkpoint.flushed_end + done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    checkpoint.flushed_end += done;
+    checkpoint.buf_len = 0;
+    return 0;
+}
+
+static int checkpoint_append(const void *data, size_t len) {
+    // The change list may be larger than the buffer, so it goes in chunks
+    while (len > 0) {
+        if (checkpoint.buf_len == sizeof(checkpoint.buf) && checkpoint_flush() == -1) {
+            return -1;
+        }
+        size_t chunk = sizeof(checkpoint.buf) - checkpoint.buf_len;
+        if (chunk > len) {
+            chunk = len;
+        }
+        memcpy(checkpoint.buf + checkpoint.buf_len, data, chunk);
+        checkpoint.buf_len += chunk;
+        data = (const uint8_t *)data + chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+static SnapshotRecord *checkpoint_slot(uint64_t token) {
+    uint64_t slot = snapshot_slot(token, checkpoint.capacity);
+    while (checkpoint.records[slot].token != 0 && checkpoint.records[slot].token != token) {
+        slot = (slot + 1) & (checkpoint.capacity - 1);
+    }
+
+    SnapshotRecord *record = &checkpoint.records[slot];
+    if (record->token == 0) {
+        // Sessions that appear mid-checkpoint must not overfill the table
+        if ((checkpoint.count + 1) * 4 > checkpoint.capacity * 3) {
+            return NULL;
+        }
+        record->token = token;
+        checkpoint.count++;
+    }
+    return record;
+}
+
+size_t checkpoint_put(uint64_t token, time_t parked_at, uint32_t player_i, uint32_t player_j,
+                      uint32_t game_over, int32_t room_id, const DiscoveredMap *discovered) {
+    // Returns the bytes written
+    if (checkpoint.fd == -1) {
+        return 0;
+    }
+    SnapshotRecord *record = checkpoint_slot(token);
+    if (!record) {
+        return 0;
+    }
+
+    // A session written again gets its tiles appended anew; the old copy is left unused
+    record->parked_at = parked_at;
+    record->player_i = player_i;
+    record->player_j = player_j;
+    record->game_over = game_over;
+    record->room_id = room_id;
+    record->tiles_offset = checkpoint.flushed_end + checkpoint.buf_len;
+    record->tile_count = discovered->count;
+
+    for (uint32_t k = 0; k < discovered->capacity; k++) {
+        if (discovered->tiles[k].key == 0) {
+            continue;
+        }
+        SnapshotTile tile;
+        tile.key = discovered->tiles[k].key;
+        tile.reserved = 0;
+        memcpy(tile.rows, discovered->tiles[k].rows, sizeof(tile.rows));
+        if (checkpoint_append(&tile, sizeof(tile)) == -1) {
+            checkpoint_abort("Error writing the checkpoint");
+            return 0;
+        }
+    }
+    return sizeof(SnapshotRecord) + (size_t)discovered->count * sizeof(SnapshotTile);
+}
+
+size_t checkpoint_put_game(GameState *gameState) {
+    return checkpoint_put(gameState->session_token, time(NULL), gameState->player_i, gameState->player_j,
+                   gameState->game_over, gameState->room ? gameState->room->id : 0, &gameState->discovered);
+}
+
+size_t checkpoint_put_parked(ParkedSession *ps) {
+    return checkpoint_put(ps->token, ps->parked_at, ps->player_i, ps->player_j, ps->game_over, ps->room_id, &ps->discovered);
+}
+
+void checkpoint_drop(uint64_t token) {
+    // An ended session must not come back after a restart
+    if (checkpoint.fd == -1 || token == 0) {
+        return;
+    }
+    uint64_t mask = checkpoint.capacity - 1;
+    uint64_t hole = snapshot_slot(token, checkpoint.capacity);
+    while (checkpoint.records[hole].token != token) {
+        if (checkpoint.records[hole].token == 0) {
+            return;
+        }
+        hole = (hole + 1) & mask;
+    }
+
+    // Shift later records of the probe run back so lookups still find them
+    for (uint64_t next = (hole + 1) & mask; checkpoint.records[next].token != 0; next = (next + 1) & mask) {
+        uint64_t home = snapshot_slot(checkpoint.records[next].token, checkpoint.capacity);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            checkpoint.records[hole] = checkpoint.records[next];
+            hole = next;
+        }
+    }
+    memset(&checkpoint.records[hole], 0, sizeof(SnapshotRecord));
+    checkpoint.count--;
+}
+
+static size_t checkpoint_carry_over(uint64_t slot, time_t now) {
+    // Sessions of the previous run nobody asked for yet are copied as they are
+    const SnapshotRecord *old = &restore_source.records[slot];
+    if (old->token == 0 || (restore_source.consumed[slot / 8] & (1u << (slot % 8))) || snapshot_expired(old, now)) {
+        return 0;
+    }
+    size_t tiles_size = (size_t)old->tile_count * sizeof(SnapshotTile);
+    if (old->tiles_offset + tiles_size > restore_source.size) {
+        return 0;
+    }
+    SnapshotRecord *record = checkpoint_slot(old->token);
+    if (!record) {
+        return 0;
+    }
+    *record = *old;
+    record->tiles_offset = checkpoint.flushed_end + checkpoint.buf_len;
+    if (checkpoint_append(restore_source.data + old->tiles_offset, tiles_size) == -1) {
+        checkpoint_abort("Error writing the checkpoint");
+        return 0;
+    }
+    return sizeof(SnapshotRecord) + tiles_size;
+}
+
+void checkpoint_step(uint64_t budget) {
+    // Live games, then parked ones, then what is left of the previous
+    // snapshot. Each call writes about budget bytes, the size of a session
+    // being its record and its discovered tiles, and the cursor picks up
+    // mid-phase on the next call, so requests keep flowing. Sessions that
+    // are parked or resumed meanwhile are written again by park_session()
+    // and resume_session(), so none slips between phases.
+    time_t now = time(NULL);
+    size_t spent = 0;
+    while (checkpoint.fd != -1 && spent < budget) {
+        spent += sizeof(SnapshotRecord); // Even an empty slot costs a look
+        if (checkpoint.phase == 0) {
+            if (checkpoint.cursor < MAX_CONNECTIONS) {
+                Connection *conn = &connections[checkpoint.cursor++];
+                if (conn->fd != -1 && conn->gameState.game_inicialized) {
+                    spent += checkpoint_put_game(&conn->gameState);
+                }
+                continue;
+            }
+        } else if (checkpoint.phase == 1) {
+            if (checkpoint.cursor < max_parked_sessions) {
+                ParkedSession *ps = &parked_sessions[checkpoint.cursor++];
+                if (ps->token != 0) {
+                    spent += checkpoint_put_parked(ps);
+                }
+                continue;
+            }
+        } else if (checkpoint.phase == 2) {
+            if (restore_source.header && checkpoint.cursor < restore_source.header->capacity) {
+                spent += checkpoint_carry_over(checkpoint.cursor++, now);
+                continue;
+            }
+        } else {
+            checkpoint_finish();
+            return;
+        }
+        checkpoint.phase++;
+        checkpoint.cursor = 0;
+    }
+}
+
+void checkpoint_finish(void) {
+    SnapshotHeader *header = (SnapshotHeader *)checkpoint.map;
+    header->version = SNAPSHOT_VERSION;
+    header->record_size = sizeof(SnapshotRecord);
+    header->base_fingerprint = maze.base_fingerprint;
+    header->maze_fingerprint = maze.fingerprint;
+    header->created_at = checkpoint.started_at;
+    header->capacity = checkpoint.capacity;
+    header->records = checkpoint.count;
+    header->changes_offset = checkpoint.flushed_end + checkpoint.buf_len;
+    header->change_count = maze_change_count;
+
+    if (checkpoint_append(maze_changes, maze_change_count * sizeof(uint64_t)) == -1 || checkpoint_flush() == -1) {
+        checkpoint_abort("Error writing the checkpoint");
+        return;
+    }
+
+    // The helper thread owns the file from here; sessions parked or ended
+    // meanwhile go to the next checkpoint
+    checkpoint_sync.fd = checkpoint.fd;
+    memcpy(checkpoint_sync.path, checkpoint.path, sizeof(checkpoint_sync.path));
+    checkpoint_sync.map = checkpoint.map;
+    checkpoint_sync.map_size = checkpoint.map_size;
+    checkpoint_sync.count = checkpoint.count;
+    checkpoint_sync.error = NULL;
+    atomic_store(&checkpoint_sync.done, 0);
+    checkpoint_sync.running = 1;
+    checkpoint.fd = -1;
+
+    if (pthread_create(&checkpoint_sync.thread, NULL, checkpoint_sync_thread, NULL) != 0) {
+        // No thread to spare: sync in place and reap right away
+        checkpoint_sync_thread(NULL);
+        checkpoint_sync.running = 0;
+        checkpoint_reap(1);
+    }
+}
+
+void *checkpoint_sync_thread(void *arg) {
+    (void)arg;
+    SnapshotHeader *header = (SnapshotHeader *)checkpoint_sync.map;
+
+    // The magic goes in last, once everything else is on disk, so a crash
+    // mid-write leaves a file that is rejected rather than half read
+    if (msync(checkpoint_sync.map, checkpoint_sync.map_size, MS_SYNC) == -1 || fsync(checkpoint_sync.fd) == -1) {
+        checkpoint_sync.error = "Error writing the checkpoint";
+    } else {
+        memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+        if (msync(checkpoint_sync.map, checkpoint_sync.map_size, MS_SYNC) == -1 ||
+            rename(checkpoint_sync.path, snapshot_path) == -1) {
+            checkpoint_sync.error = "Error writing the checkpoint";
+        }
+    }
+    if (checkpoint_sync.error) {
+        checkpoint_sync.error_errno = errno;
+        unlink(checkpoint_sync.path);
+    }
+
+    munmap(checkpoint_sync.map, checkpoint_sync.map_size);
+    close(checkpoint_sync.fd);
+    atomic_store(&checkpoint_sync.done, 1);
+    return NULL;
+}
+
+void checkpoint_reap(int wait) {
+    // wait = 0 only collects a sync that is already over
+    if (checkpoint_sync.running) {
+        if (!wait && !atomic_load(&checkpoint_sync.done)) {
+            return;
+        }
+        pthread_join(checkpoint_sync.thread, NULL);
+        checkpoint_sync.running = 0;
+    }
+    if (!atomic_load(&checkpoint_sync.done)) {
+        return;
+    }
+    atomic_store(&checkpoint_sync.done, 0);
+
+    if (checkpoint_sync.error) {
+        errno = checkpoint_sync.error_errno;
+        perror(checkpoint_sync.error);
+    } else {
+        printf("checkpoint written: %llu sessions\n", (unsigned long long)checkpoint_sync.count);
+    }
+}
+
+void checkpoint_expired(Timer *timer) {
+    checkpoint_begin();
+    timer_arm(timer, SECONDS_TO_TICKS(checkpoint_interval));
+}
+
+void terminate_handler(int sig) {
+    (void)sig;
+    terminate_requested = 1;
+}
+
+uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int command_class(int type) {
+    if (type == MOVE) {
+        return 0;
+    }
+    if (type == MAP || type == HINT) {
+        return 1;
+    }
+    return 2;
+}
+
+void init_token_buckets(Connection *conn) {
+    uint64_t now_us = monotonic_us();
+    for (int cls = 0; cls < COMMAND_CLASSES; cls++) {
+        conn->buckets[cls].tokens = (uint64_t)command_limits[cls].burst * 1000000;
+        conn->buckets[cls].updated_us = now_us;
+    }
+}
+
+int bucket_take(TokenBucket *bucket, int cls, uint64_t now_us) {
+    // rate commands per second is rate millionths of a command per microsecond
+    uint64_t capacity = (uint64_t)command_limits[cls].burst * 1000000;
+    bucket->tokens += (now_us - bucket->updated_us) * command_limits[cls].rate;
+    if (bucket->tokens > capacity) {
+        bucket->tokens = capacity;
+    }
+    bucket->updated_us = now_us;
+
+    if (bucket->tokens < 1000000) {
+        return 0;
+    }
+    bucket->tokens -= 1000000;
+    return 1;
+}
+
+void overload_batch(uint64_t wait_started_us, int events) {
+    // An epoll returning events at once means they were already queued
+    // while the previous batch ran, so they may have waited since that
+    // batch started (a checkpoint pass resets it, so its writing does not
+    // count). Events it had to wait for are fresh, and an empty poll shows
+    // no queue.
+    uint64_t now_us = monotonic_us();
+    if (events > 0 && now_us - wait_started_us < 1000 && overload.batch_started_us != 0) {
+        overload.batch_ready_us = overload.batch_started_us;
+    } else {
+        overload.batch_ready_us = now_us;
+        overload.overloaded = 0;
+    }
+    overload.batch_started_us = now_us;
+}
+
+int admit_command(Connection *conn, struct action *act) {
+    uint64_t now_us = monotonic_us();
+    uint64_t delay_us = now_us - overload.batch_ready_us;
+
+    if (overload.interval_end_us == 0) {
+        overload.interval_end_us = now_us + OVERLOAD_INTERVAL_US;
+    }
+    if (delay_us < overload.min_delay_us) {
+        overload.min_delay_us = delay_us;
+    }
+    if (now_us >= overload.interval_end_us) {
+        overload.overloaded = overload.min_delay_us > OVERLOAD_TARGET_US;
+        overload.min_delay_us = UINT64_MAX;
+        overload.interval_end_us = now_us + OVERLOAD_INTERVAL_US;
+    }
+
+    // EXIT only lightens the load. While overloaded, commands that waited
+    // too long are refused before any work is done on them.
+    if (act->type == EXIT) {
+        return 1;
+    }
+    if (overload.overloaded && delay_us > OVERLOAD_TARGET_US) {
+        rejections.overloaded++;
+        build_error(act, "error: server overloaded, try again later");
+        return 0;
+    }
+
+    int cls = command_class(act->type);
+    if (!bucket_take(&conn->buckets[cls], cls, now_us)) {
+        rejections.rate_limited[cls]++;
+        build_error(act, "error: too many commands, slow down");
+        return 0;
+    }
+    return 1;
+}
+
+void print_rejections(void) {
+    printf("rejected: %llu move, %llu map, %llu control rate limited, %llu overloaded, %llu connections shed\n",
+           (unsigned long long)rejections.rate_limited[0], (unsigned long long)rejections.rate_limited[1],
+           (unsigned long long)rejections.rate_limited[2], (unsigned long long)rejections.overloaded,
+           (unsigned long long)rejections.shed_connections);
+    fflush(stdout);
+}
+
+void stats_handler(int sig) {
+    (void)sig;
+    stats_requested = 1;
+}
+
+void timer_wheel_init(void) {
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            Timer *head = &timer_wheel.slots[level][slot];
+            head->prev = head;
+            head->next = head;
+        }
+    }
+
+    clock_start_ms = monotonic_us() / 1000;
+    timer_wheel.now = 0;
+
+    timer_init(&housekeeping_timer, housekeeping_expired, NULL);
+    timer_arm(&housekeeping_timer, SECONDS_TO_TICKS(1));
+}
+
+uint64_t current_tick(void) {
+    return (monotonic_us() / 1000 - clock_start_ms) / TIMER_TICK_MS;
+}
+
+void timer_init(Timer *timer, void (*callback)(Timer *timer), void *owner) {
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->owner = owner;
+}
+
+static void wheel_insert(Timer *timer) {
+    uint64_t expires = timer->expires < timer_wheel.now ? timer_wheel.now : timer->expires;
+    uint64_t delta = expires - timer_wheel.now;
+
+    // Pick the lowest level whose range still covers the delay
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= ((uint64_t)1 << (WHEEL_SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+
+    Timer *head = &timer_wheel.slots[level][(expires >> (WHEEL_SLOT_BITS * level)) & (WHEEL_SLOTS - 1)];
+    timer->prev = head;
+    timer->next = head->next;
+    head->next->prev = timer;
+    head->next = timer;
+}
+
+void timer_arm(Timer *timer, uint64_t delay_ticks) {
+    timer_cancel(timer);
+
+    // Ticks are processed after I/O, so a zero delay still has to wait for the next one
+    if (delay_ticks == 0) {
+        delay_ticks = 1;
+    } else if (delay_ticks >= WHEEL_MAX_TICKS) {
+        delay_ticks = WHEEL_MAX_TICKS - 1;
+    }
+
+    timer->expires = timer_wheel.now + delay_ticks;
+    wheel_insert(timer);
+}
+
+void timer_cancel(Timer *timer) {
+    if (timer->next == NULL) {
+        return;
+    }
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = NULL;
+    timer->next = NULL;
+}
+
+void timer_wheel_advance(uint64_t target) {
+    while (timer_wheel.now < target) {
+        timer_wheel.now++;
+
+        // Find the highest level that wrapped on this tick and cascade down from it
+        int top = 0;
+        while (top < WHEEL_LEVELS - 1 &&
+               (timer_wheel.now & (((uint64_t)1 << (WHEEL_SLOT_BITS * (top + 1))) - 1)) == 0) {
+            top++;
+        }
+        for (int level = top; level > 0; level--) {
+            Timer *head = &timer_wheel.slots[level][(timer_wheel.now >> (WHEEL_SLOT_BITS * level)) & (WHEEL_SLOTS - 1)];
+            while (head->next != head) {
+                Timer *timer = head->next;
+                timer_cancel(timer);
+                wheel_insert(timer); // Always lands on a lower level
+            }
+        }
+
+        // Run everything due on this tick; callbacks may arm or cancel other timers
+        Timer *head = &timer_wheel.slots[0][timer_wheel.now & (WHEEL_SLOTS - 1)];
+        while (head->next != head) {
+            Timer *timer = head->next;
+            timer_cancel(timer);
+            timer->callback(timer);
+        }
+    }
+}
 
-    if (strcmp(input_flag, "-i") != 0) {
-        fprintf(stderr, "Usage: %s <v4|v6> <port> -i <input matrix file>\n", argv[0]);
+void housekeeping_expired(Timer *timer) {
+    expire_parked_sessions(time(NULL));
+    // Descriptors may have been freed by something other than a closed connection
+    accept_resume();
+    timer_arm(timer, SECONDS_TO_TICKS(1));
+}
+
+void init_connections(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur == RLIM_INFINITY) {
+        limit.rlim_cur = 65536;
+    }
+    fd_table_size = (int)limit.rlim_cur;
+    fd_connections = calloc(fd_table_size, sizeof(Connection *));
+    if (!fd_connections) {
+        perror("Error allocating the connection table");
         exit(EXIT_FAILURE);
     }
 
-    int server_fd;
-    int opt = 1;
-    struct addrinfo hints, *res, *p;
-    int status;
+    // Every connection must be able to get a descriptor, with some left over
+    connection_limit = MAX_CONNECTIONS;
+    if (fd_table_size - RESERVED_FDS < connection_limit) {
+        connection_limit = fd_table_size > 2 * RESERVED_FDS ? fd_table_size - RESERVED_FDS : RESERVED_FDS;
+    }
 
-    memset(&hints, 0, sizeof hints);
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE; // Use the system's IP address
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        connections[i].fd = -1;
+        connections[i].next_free = (i + 1 < connection_limit) ? i + 1 : -1;
+    }
+    connections_free = 0;
+}
 
-    if (strcmp(ip_version, "v4") == 0) {
-        hints.ai_family = AF_INET;
-    } else if (strcmp(ip_version, "v6") == 0) {
-        hints.ai_family = AF_INET6;
-    } else {
-        fprintf(stderr, "Invalid IP version: %s. Use v4 or v6.\n", ip_version);
-        exit(EXIT_FAILURE);
+void accept_pause(int err) {
+    // The pending client stays in the backlog, so a level-triggered listener
+    // would fire on every wait; it sleeps until a descriptor is freed
+    if (!accept_paused) {
+        struct epoll_event ev;
+        ev.events = 0;
+        ev.data.ptr = NULL;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, listen_fd, &ev);
+        accept_paused = 1;
     }
 
-    if ((status = getaddrinfo(NULL, port, &hints, &res)) != 0) {
-        fprintf(stderr, "Error in getaddrinfo: %s\n", gai_strerror(status));
-        exit(EXIT_FAILURE);
+    accept_errors++;
+    time_t now = time(NULL);
+    if (now != accept_error_logged) {
+        fprintf(stderr, "Error in accept: %s (%llu times)\n", strerror(err), (unsigned long long)accept_errors);
+        accept_error_logged = now;
+        accept_errors = 0;
     }
+}
 
-    for (p = res; p != NULL; p = p->ai_next) {
-        if ((server_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-            perror("server: socket");
-            continue;
+void accept_resume(void) {
+    if (!accept_paused) {
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, listen_fd, &ev);
+    accept_paused = 0;
+}
+
+void accept_connections(int server_fd) {
+    while (1) {
+        struct sockaddr_storage client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+
+        int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_len);
+        if (client_fd == -1) {
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                accept_pause(errno);
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                perror("Error in accept");
+            }
+            return;
         }
 
-        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
-            perror("setsockopt");
-            close(server_fd);
+        // Memory and descriptors stay bounded: extra clients are turned away
+        if (connections_free == -1 || client_fd >= fd_table_size) {
+            close(client_fd);
             continue;
         }
 
-        if (bind(server_fd, p->ai_addr, p->ai_addrlen) == -1) {
-            close(server_fd);
-            perror("server: bind");
+        // So are new clients while overloaded, before they cost anything
+        if (overload.overloaded) {
+            rejections.shed_connections++;
+            close(client_fd);
             continue;
         }
 
-        break; // Success
+        fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+
+        Connection *conn = &connections[connections_free];
+        connections_free = conn->next_free;
+
+        conn->fd = client_fd;
+        conn->closing = 0;
+        conn->events = EPOLLIN;
+        conn->rx_len = 0;
+        conn->tx_head = 0;
+        conn->tx_count = 0;
+        conn->spectating = 0;
+        conn->frames_skipped = 0;
+        conn->indexed_token = 0;
+        conn->udp_sequence = 0;
+        conn->udp_reply = NULL;
+        init_token_buckets(conn);
+        init_game_state(&conn->gameState);
+        timer_init(&conn->idle_timer, connection_idle_expired, conn);
+        timer_init(&conn->read_timer, connection_read_expired, conn);
+        timer_init(&conn->write_timer, connection_write_expired, conn);
+        timer_arm(&conn->idle_timer, SECONDS_TO_TICKS(idle_timeout));
+        fd_connections[client_fd] = conn;
+
+        struct epoll_event ev;
+        ev.events = conn->events;
+        ev.data.ptr = conn;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev);
+
+        printf("client connected.\n");
     }
+}
 
-    if (p == NULL) {
-        fprintf(stderr, "server: failed to bind\n");
-        exit(EXIT_FAILURE);
+void close_connection(Connection *conn) {
+    // The connection dropped without EXIT: keep the game around for RESUME
+    if (conn->gameState.game_inicialized) {
+        park_session(&conn->gameState);
+        conn->gameState.game_inicialized = 0;
     }
+    discovered_free(&conn->gameState.discovered);
+    live_session_update(conn);
+
+    timer_cancel(&conn->idle_timer);
+    timer_cancel(&conn->read_timer);
+    timer_cancel(&conn->write_timer);
+    spectate_stop(conn);
+    release_queued_frames(conn);
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    fd_connections[conn->fd] = NULL;
+
+    conn->fd = -1;
+    conn->next_free = connections_free;
+    connections_free = conn - connections;
+    accept_resume();
+}
 
-    freeaddrinfo(res);
+void connection_read(Connection *conn) {
+    int frames = 0;
 
-    if (listen(server_fd, 1) == -1) {
-        perror("Error in listen");
-        close(server_fd);
-        exit(EXIT_FAILURE);
+    // Stop reading while replies are backed up; epoll resumes us once they drain
+    while (frames < MAX_FRAMES_PER_READ && !conn->closing && conn->tx_count == 0) {
+        ssize_t n = recv(conn->fd, conn->rx_buf + conn->rx_len, sizeof(struct action) - conn->rx_len, 0);
+        if (n == 0) {
+            close_connection(conn);
+            return;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close_connection(conn);
+                return;
+            }
+            break;
+        }
+
+        // The read-frame deadline starts with the first byte of a command
+        if (conn->rx_len == 0) {
+            timer_arm(&conn->read_timer, SECONDS_TO_TICKS(READ_FRAME_TIMEOUT));
+        }
+        conn->rx_len += n;
+
+        if (conn->rx_len == sizeof(struct action)) {
+            struct action act;
+            memcpy(&act, conn->rx_buf, sizeof(struct action));
+            conn->rx_len = 0;
+            timer_cancel(&conn->read_timer);
+            timer_arm(&conn->idle_timer, SECONDS_TO_TICKS(idle_timeout));
+
+            deserialize_action(&act);
+            uint32_t sequence = (act.type == MOVE || act.type == MAP) ? (uint32_t)act.moves[RETRY_SEQUENCE_SLOT] : 0;
+            if (sequence != 0) {
+                // First sent over UDP: the same record answers it, so it is never applied twice
+                struct action reply;
+                if (run_sequenced(conn, sequence, &act, &reply)) {
+                    connection_write(conn, &reply);
+                } else {
+                    build_error(&act, "error: command already superseded");
+                    send_action(conn->fd, &act);
+                }
+            } else if (admit_command(conn, &act)) {
+                process_action(conn->fd, &act, &conn->gameState);
+                live_session_update(conn);
+            } else {
+                send_action(conn->fd, &act);
+            }
+            frames++;
+        }
     }
 
-    while (1) {
-        struct sockaddr_storage client_addr;
-        socklen_t client_addr_len = sizeof(client_addr);
+    connection_update(conn);
+}
 
-        // Accept connection
-        int client_fd;
-        if ((client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_len)) == -1) {
-            perror("Error in accept");
-            close(server_fd);
-            exit(EXIT_FAILURE);
-        }
+Frame *frame_alloc(void) {
+    Frame *frame = free_frames;
+    if (frame) {
+        free_frames = frame->next_free;
+    } else if (!(frame = malloc(sizeof(Frame)))) {
+        perror("Error allocating a frame");
+        exit(EXIT_FAILURE);
+    }
+    frame->refs = 1;
+    return frame;
+}
 
-        printf("client connected.\n");
+void frame_release(Frame *frame) {
+    if (--frame->refs == 0) {
+        frame->next_free = free_frames;
+        free_frames = frame;
+    }
+}
 
-        // Initialize the game
-        GameState gameState;
-        init_game_state(&gameState);
-        // Handle the client
+void release_queued_frames(Connection *conn) {
+    while (conn->tx_count > 0) {
+        frame_release(conn->tx_queue[conn->tx_head].frame);
+        conn->tx_head = (conn->tx_head + 1) % TX_QUEUE_FRAMES;
+        conn->tx_count--;
+    }
+}
 
-        int bytes = handle_client(client_fd, &gameState, input_file);
-        if (bytes == -1 || bytes == 0) {
-            close(client_fd);
+// Returns how many bytes the socket took right away, or -1 if it is broken
+static ssize_t connection_send_now(Connection *conn, const void *data) {
+    ssize_t n;
+    do {
+        n = send(conn->fd, data, sizeof(struct action), MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            conn->closing = 1;
+            return -1;
         }
+        return 0;
     }
+    return n;
+}
 
-    close(server_fd);
-    return 0;
+static void connection_enqueue(Connection *conn, Frame *frame, size_t offset) {
+    QueuedFrame *slot = &conn->tx_queue[(conn->tx_head + conn->tx_count) % TX_QUEUE_FRAMES];
+    slot->frame = frame;
+    slot->offset = offset;
+    frame->refs++;
+
+    if (conn->tx_count++ == 0) {
+        timer_arm(&conn->write_timer, SECONDS_TO_TICKS(WRITE_TIMEOUT));
+    }
 }
 
-void read_matrix_from_file(const char *filename, GameState *gameState) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        perror("Error opening the file");
-        exit(EXIT_FAILURE);
+void connection_write(Connection *conn, const struct action *act) {
+    if (conn->closing && conn->tx_count == 0) {
+        return; // Broken connection, about to be closed
     }
 
-    // Initialize the matrix with -1
-    for (int i = 0; i < MAX_ROWS; i++) {
-        for (int j = 0; j < MAX_COLS; j++) {
-            gameState->matrix[i][j] = -1;
-        }
-    }
-
-    char line[BUFFER_SIZE];
-    int row = 0;
-    int cols_in_first_row = -1;
-
-    while (fgets(line, sizeof(line), file) && row < MAX_ROWS) {
-        int col = 0;
-        char *token = strtok(line, " \t\n");
-        while (token && col < MAX_COLS) {
-            int value = atoi(token);
-            if (value == 2) {
-                value = 5; // Represent the player with 5
-                gameState->player_i = row;
-                gameState->player_j = col;
-                gameState->inicio_i = row;
-                gameState->inicio_j = col;
-            } else if (value == 3) {
-                gameState->fim_i = row;
-                gameState->fim_j = col;
-            }
-            gameState->matrix[row][col] = value;
-            col++;
-            token = strtok(NULL, " \t\n");
-        }
-
-        if (cols_in_first_row == -1) {
-            cols_in_first_row = col;
-        } else if (col != cols_in_first_row) {
-            fprintf(stderr, "Error: Inconsistent number of columns in line %d.\n", row + 1);
-            fclose(file);
-            exit(EXIT_FAILURE);
+    // Nothing queued yet: try to hand the reply straight to the socket
+    size_t offset = 0;
+    if (conn->tx_count == 0) {
+        ssize_t n = connection_send_now(conn, act);
+        if (n == -1 || n == sizeof(struct action)) {
+            return;
         }
-
-        row++;
+        offset = n;
     }
 
-    gameState->actual_rows = row;              // Actual number of rows in the map
-    gameState->actual_cols = cols_in_first_row; // Actual number of columns in the map
+    // A client that does not read its replies is dropped
+    if (conn->tx_count == TX_QUEUE_FRAMES) {
+        release_queued_frames(conn);
+        conn->closing = 1;
+        return;
+    }
 
-    fclose(file);
+    Frame *frame = frame_alloc();
+    memcpy(frame->data, act, sizeof(struct action));
+    connection_enqueue(conn, frame, offset);
+    frame_release(frame);
 }
 
-void initialize_game(GameState *gameState, const char *filename) {
-    memset(gameState, 0, sizeof(GameState));
-    read_matrix_from_file(filename, gameState);
-    set_matrix_descoberto_to_zeros(gameState);
-    mark_positions_around_player(gameState);
-    gameState->game_over = 0; // Initialize the game as not over
-    gameState->game_inicialized = 1; // Set the game as initialized
-    printf("starting new game\n");
-}
+void connection_send_frame(Connection *conn, Frame *frame) {
+    if (conn->closing) {
+        return;
+    }
 
-void set_matrix_descoberto_to_zeros(GameState *gameState) {
-    for (uint32_t i = 0; i < gameState->actual_rows; i++) {
-        for (uint32_t j = 0; j < gameState->actual_cols; j++) {
-            gameState->matrix_decoberto[i][j] = 0;
+    size_t offset = 0;
+    if (conn->tx_count == 0) {
+        ssize_t n = connection_send_now(conn, frame->data);
+        if (n == -1) {
+            return;
+        }
+        if (n == sizeof(struct action)) {
+            conn->frames_skipped = 0;
+            return;
         }
+        offset = n;
+    } else if (conn->tx_count >= SPECTATOR_BACKLOG) {
+        // Behind already: skip this board, a newer one will follow.
+        // A spectator that keeps falling behind is dropped.
+        if (++conn->frames_skipped > MAX_SKIPPED_FRAMES) {
+            release_queued_frames(conn);
+            conn->closing = 1;
+        }
+        return;
     }
+
+    conn->frames_skipped = 0;
+    connection_enqueue(conn, frame, offset);
 }
 
-void mark_positions_around_player(GameState *gameState) {
-    for (uint32_t i = 0; i < gameState->actual_rows; i++) {
-        for (uint32_t j = 0; j < gameState->actual_cols; j++) {
-            int delta_i = i - gameState->player_i;
-            int delta_j = j - gameState->player_j;
-            int chebyshev_distance = (delta_i > delta_j) ? delta_i : delta_j; // Chebyshev distance
+void connection_flush(Connection *conn) {
+    while (conn->tx_count > 0) {
+        struct iovec iov[TX_QUEUE_FRAMES];
+        for (uint32_t k = 0; k < conn->tx_count; k++) {
+            QueuedFrame *queued = &conn->tx_queue[(conn->tx_head + k) % TX_QUEUE_FRAMES];
+            iov[k].iov_base = queued->frame->data + queued->offset;
+            iov[k].iov_len = sizeof(struct action) - queued->offset;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = conn->tx_count;
+
+        ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                release_queued_frames(conn);
+                conn->closing = 1;
+            }
+            break;
+        }
 
-            if (chebyshev_distance <= 1) {
-                gameState->matrix_decoberto[i][j] = 1; // Mark the position as 1
+        // Retire the frames that went out completely
+        while (n > 0) {
+            QueuedFrame *queued = &conn->tx_queue[conn->tx_head];
+            size_t left = sizeof(struct action) - queued->offset;
+            if ((size_t)n < left) {
+                queued->offset += n;
+                break;
             }
+            n -= left;
+            frame_release(queued->frame);
+            conn->tx_head = (conn->tx_head + 1) % TX_QUEUE_FRAMES;
+            conn->tx_count--;
         }
     }
-}
 
-int handle_client(int client_fd, GameState *gameState, const char *filename) {
-    struct action act;
-    int num_bytes;
+    connection_update(conn);
+}
 
-    while ((num_bytes = recv(client_fd, &act, sizeof(struct action), MSG_WAITALL)) > 0) {
-        deserialize_action(&act);
-        process_action(client_fd, &act, gameState, filename);
+void connection_update(Connection *conn) {
+    if (conn->tx_count == 0) {
+        timer_cancel(&conn->write_timer);
+        if (conn->closing) {
+            close_connection(conn);
+            return;
+        }
     }
 
-    if (num_bytes == 0) {
-        return 0;
+    uint32_t events = 0;
+    if (!conn->closing && conn->tx_count == 0) {
+        events |= EPOLLIN;
+    }
+    if (conn->tx_count > 0) {
+        events |= EPOLLOUT;
     }
 
-    if (num_bytes == -1) {
-        return -1;
+    if (events != conn->events) {
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = conn;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->events = events;
     }
+}
+
+void connection_idle_expired(Timer *timer) {
+    printf("client idle, closing connection\n");
+    close_connection(timer->owner);
+}
+
+void connection_read_expired(Timer *timer) {
+    printf("client did not finish its command, closing connection\n");
+    close_connection(timer->owner);
+}
 
-    return INT32_MIN;
+void connection_write_expired(Timer *timer) {
+    printf("client is not reading, closing connection\n");
+    close_connection(timer->owner);
 }
 
-void process_action(int client_fd, struct action *act, GameState *gameState, const char *filename) {
+void process_action(int client_fd, struct action *act, GameState *gameState) {
+    // Only replies that carry a board say how much of it is in use
+    memset(act->board_size, 0, sizeof(act->board_size));
+    memset(act->board_origin, 0, sizeof(act->board_origin));
+
+    // A connection either plays or watches
+    if (act->type == START || act->type == JOIN || act->type == RESUME) {
+        spectate_stop(fd_connections[client_fd]);
+    }
+
     if(gameState->game_over){
-        handle_game_over(client_fd, act, gameState, filename);
-    } else if (act->type != START && gameState->game_inicialized == 0) {
+        handle_game_over(client_fd, act, gameState);
+    } else if (act->type != START && act->type != RESUME && act->type != JOIN && act->type != SPECTATE && act->type != MUTATE && gameState->game_inicialized == 0) {
         handle_game_not_inicialized(client_fd, act);
     } else {
         switch (act->type) {
             case START:
-                handle_start(client_fd, act, gameState, filename);
+                handle_start(client_fd, act, gameState);
                 break;
 
             case MOVE:
@@ -300,11 +3222,31 @@ void process_action(int client_fd, struct action *act, GameState *gameState, con
                 break;
 
             case RESET:
-                handle_reset(client_fd, act, gameState, filename);
+                handle_reset(client_fd, act, gameState);
+                break;
+
+            case RESUME:
+                handle_resume(client_fd, act, gameState);
+                break;
+
+            case JOIN:
+                handle_join(client_fd, act, gameState);
+                break;
+
+            case SPECTATE:
+                handle_spectate(client_fd, act, gameState);
                 break;
 
             case EXIT:
-                handle_exit(client_fd, act);
+                handle_exit(client_fd, act, gameState);
+                break;
+
+            case HINT:
+                handle_hint(client_fd, act, gameState);
+                break;
+
+            case MUTATE:
+                handle_mutate(client_fd, act);
                 break;
 
             default:
@@ -316,7 +3258,11 @@ void process_action(int client_fd, struct action *act, GameState *gameState, con
 
 void send_action(int client_fd, struct action *act) {
     serialize_action(act);
-    send(client_fd, act, sizeof(struct action), 0);
+    if (client_fd == UDP_CLIENT_FD) {
+        memcpy(udp_reply, act, sizeof(struct action));
+        return;
+    }
+    connection_write(fd_connections[client_fd], act);
 }
 
 void serialize_action(struct action *act) {
@@ -329,6 +3275,12 @@ void serialize_action(struct action *act) {
             act->board[i][j] = htonl(act->board[i][j]);
         }
     }
+    act->session_token[0] = htonl(act->session_token[0]);
+    act->session_token[1] = htonl(act->session_token[1]);
+    for (int k = 0; k < 2; k++) {
+        act->board_size[k] = htonl(act->board_size[k]);
+        act->board_origin[k] = htonl(act->board_origin[k]);
+    }
 }
 
 void deserialize_action(struct action *act) {
@@ -341,6 +3293,12 @@ void deserialize_action(struct action *act) {
             act->board[i][j] = ntohl(act->board[i][j]);
         }
     }
+    act->session_token[0] = ntohl(act->session_token[0]);
+    act->session_token[1] = ntohl(act->session_token[1]);
+    for (int k = 0; k < 2; k++) {
+        act->board_size[k] = ntohl(act->board_size[k]);
+        act->board_origin[k] = ntohl(act->board_origin[k]);
+    }
 }
 
 int move_player(GameState *gameState, int direction) {
@@ -364,29 +3322,22 @@ int move_player(GameState *gameState, int direction) {
             return 0;
     }
 
-    if (new_i >= 0 && new_i < (int)gameState->actual_rows &&
-        new_j >= 0 && new_j < (int)gameState->actual_cols &&
-        gameState->matrix[new_i][new_j] != 0 && gameState->matrix[new_i][new_j] != -1) {
-
-        int cell_value = gameState->matrix[new_i][new_j];
-
-        // Update the previous position
-        if (gameState->player_i == gameState->inicio_i && gameState->player_j == gameState->inicio_j)
-            gameState->matrix[gameState->player_i][gameState->player_j] = 2; // Starting position
-        else
-            gameState->matrix[gameState->player_i][gameState->player_j] = 1; // Free path
+    if (is_walkable(new_i, new_j)) {
 
+        uint32_t old_i = gameState->player_i;
+        uint32_t old_j = gameState->player_j;
         gameState->player_i = new_i;
         gameState->player_j = new_j;
 
+        if (gameState->room) {
+            room_move(gameState, old_i, old_j);
+        }
+
         mark_positions_around_player(gameState);
 
-        if (cell_value == 3) {
+        if (maze_cell(new_i, new_j) == 3) {
             // The player reached the exit
             gameState->game_over = 1;
-            gameState->matrix[new_i][new_j] = 5; // Update to represent the player
-        } else {
-            gameState->matrix[new_i][new_j] = 5; // Update to represent the player
         }
 
         return 1; // Indicates that the player moved
@@ -399,50 +3350,80 @@ void calculate_possible_moves(GameState *gameState, int possible_moves[4]) {
     int i = gameState->player_i;
     int j = gameState->player_j;
 
-    possible_moves[0] = (i > 0 && gameState->matrix[i - 1][j] != 0 && gameState->matrix[i - 1][j] != -1) ? 1 : 0; // UP
-    possible_moves[1] = (j < (int)gameState->actual_cols - 1 && gameState->matrix[i][j + 1] != 0 && gameState->matrix[i][j + 1] != -1) ? 1 : 0; // RIGHT
-    possible_moves[2] = (i < (int)gameState->actual_rows - 1 && gameState->matrix[i + 1][j] != 0 && gameState->matrix[i + 1][j] != -1) ? 1 : 0; // DOWN
-    possible_moves[3] = (j > 0 && gameState->matrix[i][j - 1] != 0 && gameState->matrix[i][j - 1] != -1) ? 1 : 0; // LEFT
+    possible_moves[0] = is_walkable(i - 1, j); // UP
+    possible_moves[1] = is_walkable(i, j + 1); // RIGHT
+    possible_moves[2] = is_walkable(i + 1, j); // DOWN
+    possible_moves[3] = is_walkable(i, j - 1); // LEFT
+}
+
+static int window_start(int position, int size, int window) {
+    if (size <= window) {
+        return 0;
+    }
+    int start = position - window / 2;
+    if (start < 0) {
+        return 0;
+    }
+    return start > size - window ? size - window : start;
+}
+
+void board_window(GameState *gameState, int *origin_i, int *origin_j) {
+    // The board is a MAX_ROWS x MAX_COLS window of the maze centered on the
+    // player and kept inside the maze; a small maze fits whole at the origin
+    *origin_i = window_start(gameState->player_i, maze.actual_rows, MAX_ROWS);
+    *origin_j = window_start(gameState->player_j, maze.actual_cols, MAX_COLS);
 }
 
 void copy_board_to_action(GameState *gameState, struct action *act) {
-    // Copy the current state of the matrix to the action
+    // Copy the player's window of the shared maze and draw the player on top of it
+    int origin_i, origin_j;
+    board_window(gameState, &origin_i, &origin_j);
     for (int i = 0; i < MAX_ROWS; i++) {
         for (int j = 0; j < MAX_COLS; j++) {
-            act->board[i][j] = gameState->matrix[i][j];
+            act->board[i][j] = maze_cell(origin_i + i, origin_j + j);
         }
     }
-}
-
-void fill_unreachable_positions(GameState *gameState, struct action *act) {
-    int player_i = gameState->player_i;
-    int player_j = gameState->player_j;
+    act->board[gameState->player_i - origin_i][gameState->player_j - origin_j] = 5;
 
-    // Define the visibility radius (one square range, including diagonals)
-    int visibility_radius = 1;
+    act->board_size[0] = maze.actual_rows < MAX_ROWS ? maze.actual_rows : MAX_ROWS;
+    act->board_size[1] = maze.actual_cols < MAX_COLS ? maze.actual_cols : MAX_COLS;
+    act->board_origin[0] = origin_i;
+    act->board_origin[1] = origin_j;
+}
 
-    for (uint32_t i = 0; i < gameState->actual_rows; i++) {
-        for (uint32_t j = 0; j < gameState->actual_cols; j++) {
-            int delta_i = abs((int)i - player_i);
-            int delta_j = abs((int)j - player_j);
-            int distance = delta_i > delta_j ? delta_i : delta_j; // Chebyshev distance
+void fill_exit(GameState *gameState, struct action *act) {
+    int origin_i, origin_j;
+    board_window(gameState, &origin_i, &origin_j);
+    int i = (int)maze.fim_i - origin_i;
+    int j = (int)maze.fim_j - origin_j;
+    if (i >= 0 && j >= 0 && i < MAX_ROWS && j < MAX_COLS) {
+        act->board[i][j] = 3;
+    }
+}
 
-            if (distance > visibility_radius && gameState->matrix[i][j] != -1 && gameState->matrix_decoberto[i][j] == 0) {
-                act->board[i][j] = 4; // Mark as not visible
+void fill_unreachable_positions(GameState *gameState, struct action *act) {
+    int origin_i, origin_j;
+    board_window(gameState, &origin_i, &origin_j);
+
+    // What the player sees right now was discovered on its last move, so
+    // anything not discovered is out of sight
+    for (int i = origin_i; i < origin_i + MAX_ROWS; i++) {
+        for (int j = origin_j; j < origin_j + MAX_COLS; j++) {
+            if (maze_cell(i, j) != -1 && !discovered_get(&gameState->discovered, i, j)) {
+                act->board[i - origin_i][j - origin_j] = 4; // Mark as not visible
             }
         }
     }
 }
 
 void init_game_state(GameState *game_state) {
-    game_state->actual_rows = 0;
-    game_state->actual_cols = 0;
     game_state->player_i = -1;
     game_state->player_j = -1;
-    game_state->inicio_i = -1;
-    game_state->inicio_j = -1;
     game_state->game_over = 0;
     game_state->game_inicialized = 0;
+    game_state->session_token = 0;
+    game_state->room = NULL;
+    memset(&game_state->discovered, 0, sizeof(game_state->discovered));
 }
 
 void fill_possible_moves(GameState *gameState, struct action *act) {
@@ -464,14 +3445,20 @@ void build_error(struct action *act, const char* msg) {
     strcpy(act->error_message, msg);
     memset(act->moves, 0, sizeof(act->moves));
     memset(act->board, 0, sizeof(act->board));
+    memset(act->session_token, 0, sizeof(act->session_token));
 }
 
-void handle_start(int client_fd, struct action *act, GameState *gameState, const char *filename) {
+void handle_start(int client_fd, struct action *act, GameState *gameState) {
     if (!gameState->game_over) {
-        initialize_game(gameState, filename);
+        // A new game is a new session, played alone
+        room_leave(gameState);
+        checkpoint_drop(gameState->session_token);
+        gameState->session_token = 0;
+        initialize_game(gameState);
         memset(act->moves, 0, sizeof(act->moves));
         memset(act->board, 0, sizeof(act->board));
         fill_possible_moves(gameState, act);
+        fill_session_token(gameState, act);
         act->type = UPDATE;
         send_action(client_fd, act);
     }
@@ -488,8 +3475,9 @@ void handle_move(int client_fd, struct action *act, GameState *gameState) {
                 memset(act->moves, 0, sizeof(act->moves));
                 memset(act->board, 0, sizeof(act->board));
                 copy_board_to_action(gameState, act);
-                act->board[gameState->fim_i][gameState->fim_j] = 3;
+                fill_exit(gameState, act);
                 send_action(client_fd, act);
+                publish_to_spectators(client_fd, gameState, WIN);
             } else {
                 // Send normal update with type UPDATE
                 act->type = UPDATE;
@@ -497,6 +3485,7 @@ void handle_move(int client_fd, struct action *act, GameState *gameState) {
                 memset(act->board, 0, sizeof(act->board));
                 fill_possible_moves(gameState, act);
                 send_action(client_fd, act);
+                publish_to_spectators(client_fd, gameState, UPDATE);
             }
         } else {
             build_error(act, "error: you cannot go this way");
@@ -513,6 +3502,11 @@ void handle_map(int client_fd, struct action *act, GameState *gameState) {
         // Mark positions out of reach with 4
         fill_unreachable_positions(gameState, act);
 
+        // Show other players of the room that are close enough
+        if (gameState->room) {
+            fill_nearby_players(gameState, act);
+        }
+
         // Send the partial map with type UPDATE
         act->type = UPDATE;
         memset(act->moves, 0, sizeof(act->moves));
@@ -520,27 +3514,218 @@ void handle_map(int client_fd, struct action *act, GameState *gameState) {
     }
 }
 
-void handle_reset(int client_fd, struct action *act, GameState *gameState, const char *filename) {
-    // Call the function to restart the game
-    initialize_game(gameState, filename);
+void handle_reset(int client_fd, struct action *act, GameState *gameState) {
+    // Call the function to restart the game (the session token and room are kept)
+    Room *room = gameState->room;
+    if (room) {
+        room_hold(room);
+    }
+    room_leave(gameState);
+    initialize_game(gameState);
+    if (room) {
+        room_enter(room, gameState);
+        room_release(room);
+    }
 
     // Send confirmation with type UPDATE
     act->type = UPDATE;
     memset(act->moves, 0, sizeof(act->moves));
     memset(act->board, 0, sizeof(act->board));
     fill_possible_moves(gameState, act);
+    fill_session_token(gameState, act);
+    send_action(client_fd, act);
+    publish_to_spectators(client_fd, gameState, UPDATE);
+}
+
+void handle_resume(int client_fd, struct action *act, GameState *gameState) {
+    if (gameState->game_inicialized) {
+        build_error(act, "error: a game is already in progress");
+        send_action(client_fd, act);
+        return;
+    }
+
+    uint64_t token = ((uint64_t)act->session_token[0] << 32) | act->session_token[1];
+    if (!resume_session(token, gameState) && !take_over_session(token, gameState)) {
+        build_error(act, "error: invalid or expired session");
+        send_action(client_fd, act);
+        return;
+    }
+
+    printf("session resumed\n");
+    memset(act->moves, 0, sizeof(act->moves));
+    memset(act->board, 0, sizeof(act->board));
+    if (gameState->game_over) {
+        act->type = GAMEOVER;
+    } else {
+        act->type = UPDATE;
+        fill_possible_moves(gameState, act);
+    }
+    fill_session_token(gameState, act);
+    send_action(client_fd, act);
+    publish_to_spectators(client_fd, gameState, gameState->game_over ? GAMEOVER : UPDATE);
+}
+
+void handle_join(int client_fd, struct action *act, GameState *gameState) {
+    int32_t room_id = act->moves[0];
+    if (room_id <= 0) {
+        build_error(act, "error: invalid room");
+        send_action(client_fd, act);
+        return;
+    }
+
+    // The old room is left only once the new one is secured
+    Room *room = find_or_create_room(room_id);
+    if (!room) {
+        build_error(act, "error: no room available");
+        send_action(client_fd, act);
+        return;
+    }
+    room_hold(room);
+    room_leave(gameState);
+
+    // Joining a room starts a new session in it
+    checkpoint_drop(gameState->session_token);
+    gameState->session_token = 0;
+    initialize_game(gameState);
+    room_enter(room, gameState);
+    room_release(room);
+    printf("player joined room %d\n", room_id);
+
+    act->type = UPDATE;
+    memset(act->moves, 0, sizeof(act->moves));
+    memset(act->board, 0, sizeof(act->board));
+    fill_possible_moves(gameState, act);
+    fill_session_token(gameState, act);
+    send_action(client_fd, act);
+}
+
+void handle_spectate(int client_fd, struct action *act, GameState *gameState) {
+    if (gameState->game_inicialized) {
+        build_error(act, "error: a game is already in progress");
+        send_action(client_fd, act);
+        return;
+    }
+
+    uint64_t token = ((uint64_t)act->session_token[0] << 32) | act->session_token[1];
+
+    // The watched game may be live on another connection or parked
+    Connection *owner = find_live_session(token);
+    GameState *target = owner ? &owner->gameState : NULL;
+    if (target == NULL && find_parked_session(token) == -1) {
+        build_error(act, "error: invalid or expired session");
+        send_action(client_fd, act);
+        return;
+    }
+
+    Connection *conn = fd_connections[client_fd];
+    spectate_stop(conn);
+    spectate_start(conn, token);
+    printf("spectator attached\n");
+
+    // Start the spectator off with the current board
+    if (target) {
+        fill_spectator_view(target, act, target->game_over ? WIN : UPDATE);
+    } else {
+        memset(act, 0, sizeof(struct action));
+        act->type = UPDATE;
+    }
     send_action(client_fd, act);
 }
 
-void handle_exit(int client_fd, struct action *act) {
+void handle_exit(int client_fd, struct action *act, GameState *gameState) {
     printf("client disconnected\n");
 
+    // An explicit EXIT ends the session for good
+    room_leave(gameState);
+    checkpoint_drop(gameState->session_token);
+    gameState->game_inicialized = 0;
+
     act->type = UPDATE;
     memset(act->moves, 0, sizeof(act->moves));
     memset(act->board, 0, sizeof(act->board));
     send_action(client_fd, act);
 
-    close(client_fd);
+    fd_connections[client_fd]->closing = 1;
+}
+
+void handle_hint(int client_fd, struct action *act, GameState *gameState) {
+    uint32_t cell = gameState->player_i * maze.actual_cols + gameState->player_j;
+    if (distance_to_exit[cell] == DISTANCE_UNREACHABLE) {
+        build_error(act, "error: the exit cannot be reached from here");
+        send_action(client_fd, act);
+        return;
+    }
+
+    // Walk down the distance field: every step goes one cell closer to the exit
+    memset(act->moves, 0, sizeof(act->moves));
+    memset(act->board, 0, sizeof(act->board));
+    static const int directions[4] = { 1, 2, 3, 4 }; // UP, RIGHT, DOWN, LEFT
+    int steps = 0;
+    while (distance_to_exit[cell] > 0 && steps < 100) {
+        uint32_t i = cell / maze.actual_cols;
+        uint32_t j = cell % maze.actual_cols;
+        uint32_t next[4] = {
+            i > 0 ? cell - maze.actual_cols : cell,
+            j + 1 < maze.actual_cols ? cell + 1 : cell,
+            i + 1 < maze.actual_rows ? cell + maze.actual_cols : cell,
+            j > 0 ? cell - 1 : cell,
+        };
+        int d = 0;
+        while (d < 4 && (next[d] == cell || distance_to_exit[next[d]] + 1 != distance_to_exit[cell])) {
+            d++;
+        }
+        act->moves[steps++] = directions[d];
+        cell = next[d];
+    }
+
+    act->type = UPDATE;
+    send_action(client_fd, act);
+}
+
+void handle_mutate(int client_fd, struct action *act) {
+    // Admin command: moves[0] is the number of changes, then row, column
+    // and value (0 wall, 1 path) for each; error_message carries the secret
+    act->error_message[sizeof(act->error_message) - 1] = '\0';
+    if (admin_secret == NULL || strcmp(act->error_message, admin_secret) != 0) {
+        build_error(act, "error: not authorized");
+        send_action(client_fd, act);
+        return;
+    }
+
+    int count = act->moves[0];
+    if (count < 1 || count > (int)((sizeof(act->moves) / sizeof(act->moves[0]) - 1) / 3)) {
+        build_error(act, "error: invalid maze change");
+        send_action(client_fd, act);
+        return;
+    }
+
+    // Every change is checked before any is made, so a batch applies whole or not at all
+    for (int k = 0; k < count; k++) {
+        int32_t *change = &act->moves[1 + 3 * k];
+        int result = (change[0] < 0 || change[1] < 0) ? -1 : maze_check_cell(change[0], change[1], change[2]);
+        if (result < 0) {
+            build_error(act, result == -2 ? "error: a player stands on that cell" : "error: invalid maze change");
+            send_action(client_fd, act);
+            return;
+        }
+    }
+
+    int changed = 0;
+    for (int k = 0; k < count; k++) {
+        int32_t *change = &act->moves[1 + 3 * k];
+        int result = maze_set_cell(change[0], change[1], change[2]);
+        if (result > 0) {
+            changed += result;
+        }
+    }
+    printf("maze changed: %d cells\n", changed);
+
+    act->type = UPDATE;
+    memset(act->moves, 0, sizeof(act->moves));
+    memset(act->board, 0, sizeof(act->board));
+    memset(act->error_message, 0, sizeof(act->error_message));
+    act->moves[0] = changed;
+    send_action(client_fd, act);
 }
 
 void handle_default(int client_fd, struct action *act) {
@@ -562,7 +3747,7 @@ void handle_commands_game_over(int client_fd, struct action *act) {
     send_action(client_fd, act);
 }
 
-void handle_game_over(int client_fd, struct action *act, GameState *gameState, const char *filename) {
+void handle_game_over(int client_fd, struct action *act, GameState *gameState) {
     switch (act->type) {
             case START:
                 handle_commands_game_over(client_fd, act);
@@ -576,12 +3761,28 @@ void handle_game_over(int client_fd, struct action *act, GameState *gameState, c
                 handle_commands_game_over(client_fd, act);
                 break;
 
+            case JOIN:
+                handle_commands_game_over(client_fd, act);
+                break;
+
+            case SPECTATE:
+                handle_commands_game_over(client_fd, act);
+                break;
+
             case RESET:
-                handle_reset(client_fd, act, gameState, filename);
+                handle_reset(client_fd, act, gameState);
+                break;
+
+            case RESUME:
+                handle_resume(client_fd, act, gameState);
                 break;
 
             case EXIT:
-                handle_exit(client_fd, act);
+                handle_exit(client_fd, act, gameState);
+                break;
+
+            case MUTATE:
+                handle_mutate(client_fd, act);
                 break;
 
             default:
@@ -0,0 +1,52 @@
+// distance_check.c
+
+// Checks the incremental repair of the distance field against a full BFS.
+// The server is compiled in whole, with its main renamed, so the check
+// runs the same maze_set_cell() the MUTATE command does.
+#define main server_main
+#include "../server.c"
+#undef main
+
+void check_usage(const char *program);
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        check_usage(argv[0]);
+    }
+
+    read_matrix_from_file(argv[1], &maze);
+    init_parked_sessions();
+    distance_init();
+    srand((unsigned)strtoul(argv[2], NULL, 10));
+    int changes = atoi(argv[3]);
+
+    // Random walls going up and coming down, each followed by a full BFS
+    // that the repaired field must match cell for cell
+    size_t cells = (size_t)maze.actual_rows * maze.actual_cols;
+    int applied = 0;
+    for (int k = 0; k < changes; k++) {
+        uint32_t i = (uint32_t)rand() % maze.actual_rows;
+        uint32_t j = (uint32_t)rand() % maze.actual_cols;
+        if (maze_set_cell(i, j, rand() % 2) != 1) {
+            continue;
+        }
+        applied++;
+
+        uint32_t *repaired = distance_to_exit;
+        distance_init();
+        if (memcmp(repaired, distance_to_exit, cells * sizeof(uint32_t)) != 0) {
+            fprintf(stderr, "%s: distances differ from a full BFS after change %d (cell %u %u)\n",
+                    argv[1], k, i, j);
+            exit(EXIT_FAILURE);
+        }
+        free(repaired);
+    }
+
+    printf("%s: %d changes applied, distances match a full BFS\n", argv[1], applied);
+    return 0;
+}
+
+void check_usage(const char *program) {
+    fprintf(stderr, "Usage: %s <input matrix file> <seed> <changes>\n", program);
+    exit(EXIT_FAILURE);
+}